@@ -0,0 +1,338 @@
+/* SPDX-License-Identifier: GPL-2.0 */
+#include <linux/init.h>
+#include <linux/types.h>
+#include <linux/module.h>
+#include <linux/kernel.h>
+#include <linux/moduleparam.h>
+#include <linux/slab.h>
+#include <linux/list.h>
+#include <linux/spinlock.h>
+#include <linux/sched/mm.h>
+#include <linux/falloc.h>
+#include <linux/uio.h>
+#include <linux/blkdev.h>
+#include <linux/blk-mq.h>
+
+#include "scull.h"
+
+/* per request data */
+struct sbull_cmd {
+	blk_status_t		status;
+};
+
+/* requests done on the poll queue, waiting for the poller */
+struct sbull_queue {
+	spinlock_t		lock;
+	struct list_head	done;
+};
+
+/* block device over the scull quanta */
+struct sbull_device {
+	struct scull_device	*storage;
+	struct blk_mq_tag_set	tags;
+	struct sbull_queue	*queues;	/* per hardware queue */
+	struct gendisk		*disk;
+};
+
+static struct sbull_driver {
+	int				major;
+	unsigned int			nr_devs;
+	unsigned long			size_mb;
+	unsigned int			queue_depth;
+	unsigned int			poll_queues;
+	unsigned int			block_size;	/* logical */
+	struct block_device_operations	fops;
+	struct blk_mq_ops		ops;
+	struct sbull_device		*devs;
+	const char			*name;
+} sbull_driver = {
+	.nr_devs	= 1,
+	.size_mb	= 256,
+	.queue_depth	= 128,
+	.poll_queues	= 1,
+	.block_size	= SECTOR_SIZE,
+	.name		= "sbull",
+};
+module_param_named(nr_devs, sbull_driver.nr_devs, uint, 0444);
+module_param_named(size_mb, sbull_driver.size_mb, ulong, 0444);
+module_param_named(queue_depth, sbull_driver.queue_depth, uint, 0444);
+module_param_named(poll_queues, sbull_driver.poll_queues, uint, 0444);
+module_param_named(block_size, sbull_driver.block_size, uint, 0444);
+
+/* sbull_transfer() copies the segments straight between the bio pages
+ * and the quanta. */
+static blk_status_t sbull_transfer(struct sbull_device *dev,
+				  struct request *rq)
+{
+	loff_t pos = (loff_t)blk_rq_pos(rq) << SECTOR_SHIFT;
+	bool write = op_is_write(req_op(rq));
+	struct req_iterator it;
+	struct iov_iter iter;
+	struct bio_vec bvec;
+	ssize_t ret;
+
+	rq_for_each_segment(bvec, rq, it) {
+		iov_iter_bvec(&iter, write ? WRITE : READ, &bvec, 1,
+			      bvec.bv_len);
+		if (write)
+			ret = scull_write_at(dev->storage, pos, &iter);
+		else
+			ret = scull_read_at(dev->storage, pos, &iter);
+		if (ret != bvec.bv_len)
+			return BLK_STS_IOERR;
+		pos += bvec.bv_len;
+	}
+	return BLK_STS_OK;
+}
+
+static blk_status_t sbull_queue_rq(struct blk_mq_hw_ctx *hctx,
+				   const struct blk_mq_queue_data *bd)
+{
+	struct sbull_device *dev = hctx->queue->queuedata;
+	struct request *rq = bd->rq;
+	struct sbull_cmd *cmd = blk_mq_rq_to_pdu(rq);
+	struct sbull_queue *sq = hctx->driver_data;
+	blk_status_t status = BLK_STS_OK;
+	unsigned int flags;
+
+	blk_mq_start_request(rq);
+	/* no reclaim through us while allocating the quanta */
+	flags = memalloc_noio_save();
+	switch (req_op(rq)) {
+	case REQ_OP_READ:
+	case REQ_OP_WRITE:
+		status = sbull_transfer(dev, rq);
+		break;
+	case REQ_OP_DISCARD:
+	case REQ_OP_WRITE_ZEROES:
+		/* zeros are holes */
+		if (scull_fallocate(dev->storage,
+				    FALLOC_FL_PUNCH_HOLE|FALLOC_FL_KEEP_SIZE,
+				    (loff_t)blk_rq_pos(rq) << SECTOR_SHIFT,
+				    blk_rq_bytes(rq)))
+			status = BLK_STS_IOERR;
+		break;
+	case REQ_OP_FLUSH:
+		break;
+	default:
+		status = BLK_STS_NOTSUPP;
+		break;
+	}
+	memalloc_noio_restore(flags);
+	cmd->status = status;
+	/* the poller completes it on the poll queue, and the softirq does
+	 * as the interrupt handler would on the others */
+	if (hctx->type == HCTX_TYPE_POLL) {
+		spin_lock(&sq->lock);
+		list_add_tail(&rq->queuelist, &sq->done);
+		spin_unlock(&sq->lock);
+	} else
+		blk_mq_complete_request(rq);
+	return BLK_STS_OK;
+}
+
+static void sbull_complete(struct request *rq)
+{
+	struct sbull_cmd *cmd = blk_mq_rq_to_pdu(rq);
+
+	blk_mq_end_request(rq, cmd->status);
+}
+
+/* sbull_poll() completes the requests one by one, as they are done
+ * already, and leaves iob alone. */
+static int sbull_poll(struct blk_mq_hw_ctx *hctx, struct io_comp_batch *iob)
+{
+	struct sbull_queue *sq = hctx->driver_data;
+	struct request *rq, *next;
+	LIST_HEAD(done);
+	int nr = 0;
+
+	spin_lock(&sq->lock);
+	list_splice_init(&sq->done, &done);
+	spin_unlock(&sq->lock);
+	list_for_each_entry_safe(rq, next, &done, queuelist) {
+		list_del_init(&rq->queuelist);
+		sbull_complete(rq);
+		nr++;
+	}
+	return nr;
+}
+
+static int sbull_init_hctx(struct blk_mq_hw_ctx *hctx, void *data,
+			   unsigned int index)
+{
+	struct sbull_device *dev = data;
+
+	hctx->driver_data = &dev->queues[index];
+	return 0;
+}
+
+/* sbull_map_queues() puts the poll queues after the default ones */
+static int sbull_map_queues(struct blk_mq_tag_set *set)
+{
+	struct sbull_driver *drv = &sbull_driver;
+	struct blk_mq_queue_map *map;
+	unsigned int offset = 0;
+	int i;
+
+	for (i = 0; i < set->nr_maps; i++) {
+		map = &set->map[i];
+		if (i == HCTX_TYPE_POLL)
+			map->nr_queues = drv->poll_queues;
+		else if (i == HCTX_TYPE_DEFAULT)
+			map->nr_queues = set->nr_hw_queues-drv->poll_queues;
+		else
+			map->nr_queues = 0;
+		map->queue_offset = offset;
+		offset += map->nr_queues;
+		if (map->nr_queues)
+			blk_mq_map_queues(map);
+	}
+	return 0;
+}
+
+static int init_driver(struct sbull_driver *drv)
+{
+	if (!drv->nr_devs || drv->nr_devs > 256 || !drv->size_mb ||
+	    !drv->queue_depth || drv->poll_queues > nr_cpu_ids ||
+	    !is_power_of_2(drv->block_size) ||
+	    drv->block_size < SECTOR_SIZE || drv->block_size > PAGE_SIZE)
+		return -EINVAL;
+	memset(&drv->fops, 0, sizeof(struct block_device_operations));
+	drv->fops.owner		= THIS_MODULE;
+	memset(&drv->ops, 0, sizeof(struct blk_mq_ops));
+	drv->ops.queue_rq	= sbull_queue_rq;
+	drv->ops.complete	= sbull_complete;
+	drv->ops.poll		= sbull_poll;
+	drv->ops.init_hctx	= sbull_init_hctx;
+	drv->ops.map_queues	= sbull_map_queues;
+	return 0;
+}
+
+static int init_device(struct sbull_driver *drv, struct sbull_device *dev,
+		       int i)
+{
+	unsigned int nr = nr_cpu_ids+drv->poll_queues;
+	loff_t size = (loff_t)drv->size_mb << 20;
+	struct request_queue *q;
+	struct sbull_queue *sq;
+	int err;
+
+	dev->storage = scull_create(size);
+	if (IS_ERR(dev->storage))
+		return PTR_ERR(dev->storage);
+	dev->queues = kcalloc(nr, sizeof(struct sbull_queue), GFP_KERNEL);
+	if (!dev->queues) {
+		err = -ENOMEM;
+		goto destroy;
+	}
+	for (sq = dev->queues; sq < dev->queues+nr; sq++) {
+		spin_lock_init(&sq->lock);
+		INIT_LIST_HEAD(&sq->done);
+	}
+	/* hardware queue per CPU, and the poll queues after them.  The
+	 * storage sleeps on its locks. */
+	dev->tags.ops		= &drv->ops;
+	dev->tags.nr_hw_queues	= nr;
+	dev->tags.nr_maps	= drv->poll_queues ? HCTX_MAX_TYPES : 1;
+	dev->tags.queue_depth	= drv->queue_depth;
+	dev->tags.cmd_size	= sizeof(struct sbull_cmd);
+	dev->tags.numa_node	= NUMA_NO_NODE;
+	dev->tags.flags		= BLK_MQ_F_SHOULD_MERGE|BLK_MQ_F_BLOCKING;
+	dev->tags.driver_data	= dev;
+	err = blk_mq_alloc_tag_set(&dev->tags);
+	if (err)
+		goto free_queues;
+	dev->disk = blk_mq_alloc_disk(&dev->tags, dev);
+	if (IS_ERR(dev->disk)) {
+		err = PTR_ERR(dev->disk);
+		goto free;
+	}
+	dev->disk->major	= drv->major;
+	dev->disk->first_minor	= i;
+	dev->disk->minors	= 1;
+	dev->disk->fops		= &drv->fops;
+	dev->disk->private_data	= dev;
+	snprintf(dev->disk->disk_name, DISK_NAME_LEN, "%s%d", drv->name, i);
+	set_capacity(dev->disk, size >> SECTOR_SHIFT);
+	q = dev->disk->queue;
+	blk_queue_logical_block_size(q, drv->block_size);
+	blk_queue_physical_block_size(q, PAGE_SIZE);
+	blk_queue_flag_set(QUEUE_FLAG_NONROT, q);
+	blk_queue_flag_clear(QUEUE_FLAG_ADD_RANDOM, q);
+	q->limits.discard_granularity = drv->block_size;
+	/* the discard limit is all it takes to discard */
+	blk_queue_max_discard_sectors(q, UINT_MAX >> SECTOR_SHIFT);
+	blk_queue_max_write_zeroes_sectors(q, UINT_MAX >> SECTOR_SHIFT);
+	err = add_disk(dev->disk);
+	if (err)
+		goto cleanup;
+	return 0;
+cleanup:
+	blk_cleanup_disk(dev->disk);
+free:
+	blk_mq_free_tag_set(&dev->tags);
+free_queues:
+	kfree(dev->queues);
+destroy:
+	scull_destroy(dev->storage);
+	return err;
+}
+
+static void term_device(struct sbull_device *dev)
+{
+	del_gendisk(dev->disk);
+	blk_cleanup_disk(dev->disk);
+	blk_mq_free_tag_set(&dev->tags);
+	kfree(dev->queues);
+	scull_destroy(dev->storage);
+}
+
+static int __init init(void)
+{
+	struct sbull_driver *drv = &sbull_driver;
+	int i, err;
+
+	err = init_driver(drv);
+	if (err)
+		return err;
+	drv->major = register_blkdev(0, drv->name);
+	if (drv->major < 0)
+		return drv->major;
+	drv->devs = kcalloc(drv->nr_devs, sizeof(struct sbull_device),
+			    GFP_KERNEL);
+	if (!drv->devs) {
+		err = -ENOMEM;
+		goto unregister;
+	}
+	for (i = 0; i < drv->nr_devs; i++) {
+		err = init_device(drv, &drv->devs[i], i);
+		if (err)
+			goto term;
+	}
+	return 0;
+term:
+	while (--i >= 0)
+		term_device(&drv->devs[i]);
+	kfree(drv->devs);
+unregister:
+	unregister_blkdev(drv->major, drv->name);
+	return err;
+}
+module_init(init);
+
+static void __exit term(void)
+{
+	struct sbull_driver *drv = &sbull_driver;
+	int i;
+
+	for (i = 0; i < drv->nr_devs; i++)
+		term_device(&drv->devs[i]);
+	kfree(drv->devs);
+	unregister_blkdev(drv->major, drv->name);
+}
+module_exit(term);
+
+MODULE_LICENSE("GPL");
+MODULE_AUTHOR("Kei Nohguchi <kei@nohguchi.com>");
+MODULE_DESCRIPTION("Simple Block Utility for Loading Localities");
@@ -5,25 +5,184 @@
 #include <linux/kernel.h>
 #include <linux/string.h>
 #include <linux/fs.h>
+#include <linux/file.h>
+#include <linux/anon_inodes.h>
+#include <linux/falloc.h>
 #include <linux/cdev.h>
 #include <linux/device.h>
 #include <linux/sysfs.h>
+#include <linux/moduleparam.h>
 #include <linux/mutex.h>
+#include <linux/rwsem.h>
+#include <linux/sched/signal.h>
+#include <linux/spinlock.h>
+#include <linux/srcu.h>
+#include <linux/percpu.h>
 #include <linux/slab.h>
+#include <linux/mm.h>
+#include <linux/highmem.h>
+#include <linux/pagemap.h>
+#include <linux/pfn_t.h>
+#include <linux/nodemask.h>
+#include <linux/vmalloc.h>
+#include <linux/log2.h>
+#include <linux/xarray.h>
+#include <linux/uio.h>
+#include <linux/jiffies.h>
+#include <linux/ktime.h>
+#include <linux/math64.h>
+#include <linux/atomic.h>
+#include <linux/refcount.h>
+#include <linux/workqueue.h>
+#include <linux/shrinker.h>
+#include <linux/crypto.h>
 #include <linux/uaccess.h>
 
+#include "scull.h"
+
+/* qset grows on demand up to scull_data.qset slots, and is replaced as
+ * a whole when it does */
 struct scull_qset {
-	struct scull_qset	*next;
+	size_t			nr;	/* allocated quanta */
+	size_t			cap;	/* slots */
+	unsigned long		atime;	/* last access in jiffies */
+	struct rcu_head		rcu;
 	void			*data[];
 };
+#define SCULL_QSET_MIN		4	/* slots of the new qset */
 
-struct scull_device {
-	struct mutex		lock;
-	struct scull_qset	*data;
+/* compressed quantum, tagged with SCULL_ZQUANTUM in the qset slot */
+struct scull_zquantum {
+	unsigned int		len;
+	u8			data[];
+};
+#define SCULL_ZQUANTUM		1UL
+
+/* quantum shared between the slots by SCULL_IOC_CLONE and SCULL_IOC_COPY,
+ * tagged with SCULL_SHARED in the qset slot, and copied on write */
+struct scull_shared {
+	refcount_t		ref;
+	void			*data;
+	struct rcu_head		rcu;
+};
+#define SCULL_SHARED		2UL
+
+/* raw or shared quantum released after the lockless readers are done
+ * with it */
+struct scull_qfree {
+	void			*data;
+	size_t			quantum;
+	struct rcu_head		rcu;
+};
+
+#define SCULL_INLINE_MAX	128	/* the small data kept in scull_data */
+
+/* quanta left in the backing file, restored on the first access */
+struct scull_restore {
+	unsigned long		nr;	/* quanta in the file */
+	atomic_long_t		left;	/* not restored yet */
+	unsigned long		done[];	/* restored, or overwritten */
+};
+
+/* scull_data is replaced as a whole on trim and resize, and freed
+ * after the SRCU grace period so that the readers can go lockless. */
+struct scull_data {
+	struct xarray		qsets;	/* qset index to scull_qset */
 	size_t			qset;
 	size_t			quantum;
+	atomic_long_t		nr_quanta;	/* uncompressed quanta */
+	atomic_long_t		zbytes;		/* compressed size */
+	atomic_long_t		zorig;		/* original size of above */
+	struct scull_device	*dev;
+	long			pending;	/* bytes left to free */
+	struct rcu_head		rcu;
+	struct work_struct	free;
+	bool			inlined;	/* data is in idata, no qsets */
+	u8			idata[SCULL_INLINE_MAX];
+	struct scull_restore	*restore;	/* NULL once trimmed */
+};
+
+#define SCULL_NR_LOCKS		64	/* qset lock stripes */
+#define SCULL_QUANTUM_MAX	(2*1024*1024)
+#define SCULL_NR_BUCKETS	32	/* log2 nanoseconds */
+#define SCULL_POOL_SIZE		16
+#define SCULL_POOL_BYTES	(256*1024)	/* per CPU */
+#define SCULL_NUMA_LOCAL	NUMA_NO_NODE
+#define SCULL_NUMA_INTERLEAVE	(-2)
+
+enum scull_stat {
+	SCULL_STAT_READ,
+	SCULL_STAT_WRITE,
+	SCULL_STAT_TRIM,
+	SCULL_STAT_ALLOC,
+	SCULL_STAT_LOCK,	/* waiting on dev->lock, or a qset lock stripe */
+	SCULL_NR_STATS,
+};
+
+/* per-CPU, so that the I/O paths only touch the local cachelines */
+struct scull_stats {
+	u64			nr[SCULL_NR_STATS];
+	u64			bytes[SCULL_NR_STATS];
+	u64			ns[SCULL_NR_STATS];
+	u64			hist[SCULL_NR_STATS][SCULL_NR_BUCKETS];
+};
+
+/* per-CPU pre-zeroed quanta for the writers, refilled by the worker */
+struct scull_pool {
+	spinlock_t		lock;	/* against the worker and the trim */
+	bool			want;	/* refill requested */
+	unsigned int		nr;
+	size_t			quantum;
+	void			*quanta[SCULL_POOL_SIZE];
+};
+
+struct scull_device {
+	struct rw_semaphore	lock;	/* exclusive for trim and resize */
+	struct rw_semaphore	locks[SCULL_NR_LOCKS];
+	struct srcu_struct	srcu;	/* lockless readers */
+	struct scull_data __rcu	*data;
+	spinlock_t		size_lock;
 	size_t			size;
-	struct cdev		cdev;
+	unsigned int		compress_ms;	/* 0 disables the compression */
+	struct delayed_work	compress;
+	atomic64_t		decompress_nr;
+	atomic64_t		decompress_ns;
+	atomic_long_t		pending_free;	/* bytes of the trimmed data */
+	int			numa_policy;	/* local, interleave or the node */
+	int			numa_next;	/* last interleaved node */
+	atomic_long_t		*numa_allocs;	/* quanta allocated per node */
+	atomic_long_t		*numa_resident;	/* quanta in the slots per node */
+	struct scull_stats __percpu	*stats;
+	struct scull_pool __percpu	*pool;
+	struct work_struct	refill;
+	bool			sealed;		/* immutable, see scull_seal() */
+	atomic_t		mapped;		/* vmas */
+	atomic_t		wmapped;	/* shared and writable vmas */
+	struct file		*backing;	/* persisted into, if any */
+	struct mutex		snaps_lock;
+	struct list_head	snaps;	/* restoring from the backing file */
+};
+
+/* scull_snap is the read-only copy of the device, frozen qset by qset,
+ * sharing the quanta with it. */
+struct scull_snap {
+	struct scull_data	*sd;
+	size_t			size;
+	struct mutex		lock;	/* buf and the restore */
+	void			*buf;	/* decompressed quantum */
+	struct list_head	node;	/* on dev->snaps */
+};
+
+/* scull_zstrm is the per-CPU decompression context, taken as zswap
+ * does, with the mutex for the task migrated in between. */
+struct scull_zstrm {
+	struct mutex		lock;
+	struct crypto_comp	*tfm;
+};
+
+/* scull_node is the minor, which gets the device on the first open. */
+struct scull_node {
+	struct scull_device	*dev;
 	struct device		base;
 };
 
@@ -31,306 +190,3425 @@ static struct scull_driver {
 	dev_t			devt;
 	size_t			default_qset;
 	size_t			default_quantum;
+	char			*compressor;
+	char			*backing;	/* prefix of the backing files */
+	struct crypto_comp	*tfm;
+	struct mutex		zlock;	/* tfm and zbuf, to compress */
+	void			*zbuf;
+	struct scull_zstrm __percpu	*zstrm;	/* to decompress */
+	struct shrinker		shrinker;
+	struct workqueue_struct	*wq;	/* frees the trimmed data */
 	struct file_operations	fops;
+	struct file_operations	snap_fops;
+	struct vm_operations_struct	vm_ops;
 	struct device_type	type;
 	struct device_driver	base;
-	struct scull_device	devs[4];
+	struct cdev		cdev;	/* for all the minors */
+	struct mutex		lock;	/* device instantiation */
+	unsigned int		nr_devs;
+	struct scull_node	*nodes;
+	struct scull_device	idle;	/* shown for the idle nodes */
 } scull_driver = {
+	.nr_devs		= 4,
 	.default_qset		= 1024,
 	.default_quantum	= PAGE_SIZE,
+	.compressor		= "lz4",
 	.base.name		= "scull",
 	.base.owner		= THIS_MODULE,
 };
+module_param_named(compressor, scull_driver.compressor, charp, 0444);
+module_param_named(backing, scull_driver.backing, charp, 0444);
+module_param_named(nr_devs, scull_driver.nr_devs, uint, 0444);
+
+/* scull_quantum_page() returns the page backing the quantum address. */
+static struct page *scull_quantum_page(void *addr)
+{
+	if (is_vmalloc_addr(addr))
+		return vmalloc_to_page(addr);
+	return virt_to_page(addr);
+}
+
+/* scull_nid() returns the node for the next quantum under the policy. */
+static int scull_nid(struct scull_device *dev)
+{
+	int nid = READ_ONCE(dev->numa_policy);
+
+	if (nid == SCULL_NUMA_INTERLEAVE) {
+		/* racy, but good enough to spread the quanta */
+		nid = next_node_in(READ_ONCE(dev->numa_next), node_online_map);
+		WRITE_ONCE(dev->numa_next, nid);
+	}
+	/* the bound node could have gone offline */
+	if (nid != SCULL_NUMA_LOCAL && !node_online(nid))
+		nid = SCULL_NUMA_LOCAL;
+	return nid;
+}
+
+/* scull_account() accounts the operation started at start ns. */
+static void scull_account(struct scull_device *dev, enum scull_stat stat,
+			  size_t bytes, u64 start)
+{
+	u64 ns = ktime_get_ns()-start;
+	struct scull_stats *st;
+
+	st = get_cpu_ptr(dev->stats);
+	st->nr[stat]++;
+	st->bytes[stat] += bytes;
+	st->ns[stat] += ns;
+	st->hist[stat][min_t(int, ilog2(ns|1), SCULL_NR_BUCKETS-1)]++;
+	put_cpu_ptr(dev->stats);
+}
+
+/* quanta of a page or larger are backed by pages so that mmap(2) and
+ * splice(2) can hand them out.  Power of two quanta try a compound page
+ * first, and fall back to the vmalloc page array under fragmentation. */
+static void *scull_alloc_node(struct scull_device *dev, size_t quantum,
+			      int nid)
+{
+	gfp_t gfp = GFP_KERNEL|__GFP_ZERO|__GFP_COMP;
+	struct page *page;
+	void *data;
+
+	if (quantum < PAGE_SIZE) {
+		data = kzalloc_node(quantum, GFP_KERNEL, nid);
+		goto out;
+	}
+	if (is_power_of_2(quantum)) {
+		if (quantum > PAGE_SIZE)
+			gfp |= __GFP_NORETRY|__GFP_NOWARN;
+		page = alloc_pages_node(nid, gfp, get_order(quantum));
+		if (page) {
+			data = page_address(page);
+			goto out;
+		}
+	}
+	data = vzalloc_node(quantum, nid);
+out:
+	if (data)
+		atomic_long_inc(&dev->numa_allocs[page_to_nid(scull_quantum_page(data))]);
+	return data;
+}
+
+static void scull_free_quantum(void *data, size_t quantum)
+{
+	if (quantum < PAGE_SIZE)
+		kfree(data);
+	else if (is_vmalloc_addr(data))
+		vfree(data);
+	else
+		free_pages((unsigned long)data, get_order(quantum));
+}
+
+static unsigned int scull_pool_depth(size_t quantum)
+{
+	return clamp_t(size_t, SCULL_POOL_BYTES/quantum, 1, SCULL_POOL_SIZE);
+}
+
+/* scull_pool_get() takes a zeroed quantum from the local pool, and asks
+ * for the refill once it runs low. */
+static void *scull_pool_get(struct scull_device *dev, size_t quantum)
+{
+	struct scull_pool *pool;
+	void *data = NULL;
+	bool want;
+
+	pool = get_cpu_ptr(dev->pool);
+	spin_lock(&pool->lock);
+	if (pool->nr && pool->quantum == quantum)
+		data = pool->quanta[--pool->nr];
+	want = !pool->want && (pool->quantum != quantum ||
+			       pool->nr <= scull_pool_depth(quantum)/2);
+	if (want)
+		pool->want = true;
+	spin_unlock(&pool->lock);
+	put_cpu_ptr(dev->pool);
+	if (want)
+		queue_work(scull_driver.wq, &dev->refill);
+	return data;
+}
+
+/* scull_recycle() puts the quantum back to the local pool, zeroing it
+ * when dirty, and returns false when the pool has no room for it, or
+ * the quantum is off the node the policy allocates on. */
+static bool scull_recycle(struct scull_device *dev, size_t quantum,
+			  void *data, bool dirty)
+{
+	int cpu = raw_smp_processor_id(), nid = READ_ONCE(dev->numa_policy);
+	struct scull_pool *pool = per_cpu_ptr(dev->pool, cpu);
+	unsigned int depth = scull_pool_depth(quantum);
+	bool done = false;
+
+	if (READ_ONCE(pool->quantum) != quantum || READ_ONCE(pool->nr) >= depth)
+		return false;
+	if (nid == SCULL_NUMA_LOCAL)
+		nid = cpu_to_node(cpu);
+	if (nid != SCULL_NUMA_INTERLEAVE &&
+	    page_to_nid(scull_quantum_page(data)) != nid)
+		return false;
+	if (dirty)
+		memset(data, 0, quantum);
+	spin_lock(&pool->lock);
+	if (pool->quantum == quantum && pool->nr < depth) {
+		pool->quanta[pool->nr++] = data;
+		done = true;
+	}
+	spin_unlock(&pool->lock);
+	return done;
+}
+
+/* scull_pool_drain() frees the pooled quanta, unless they are of the
+ * given size, and returns how many. */
+static unsigned int scull_pool_drain(struct scull_pool *pool, size_t quantum)
+{
+	void *quanta[SCULL_POOL_SIZE];
+	unsigned int i, nr = 0;
+	size_t size;
+
+	spin_lock(&pool->lock);
+	size = pool->quantum;
+	if (size != quantum) {
+		nr = pool->nr;
+		memcpy(quanta, pool->quanta, sizeof(void *)*nr);
+		pool->nr = 0;
+		pool->quantum = quantum;
+	}
+	spin_unlock(&pool->lock);
+	for (i = 0; i < nr; i++)
+		scull_free_quantum(quanta[i], size);
+	return nr;
+}
+
+/* scull_drain_pools() frees all the pooled quanta.  The pools refill on
+ * the next allocation. */
+static unsigned long scull_drain_pools(struct scull_device *dev)
+{
+	unsigned long nr = 0;
+	int cpu;
+
+	for_each_possible_cpu(cpu)
+		nr += scull_pool_drain(per_cpu_ptr(dev->pool, cpu), 0);
+	return nr;
+}
+
+/* scull_pooled() returns the number of the pooled quanta, and their
+ * bytes. */
+static unsigned long scull_pooled(struct scull_device *dev, size_t *bytes)
+{
+	struct scull_pool *pool;
+	unsigned long nr = 0;
+	unsigned int n;
+	int cpu;
+
+	*bytes = 0;
+	for_each_possible_cpu(cpu) {
+		pool = per_cpu_ptr(dev->pool, cpu);
+		spin_lock(&pool->lock);
+		n = pool->nr;
+		*bytes += n*pool->quantum;
+		spin_unlock(&pool->lock);
+		nr += n;
+	}
+	return nr;
+}
+
+/* the pools are filled in the current quantum size, on the node of the
+ * CPU under the local policy */
+static void scull_refill_work(struct work_struct *work)
+{
+	struct scull_device *dev = container_of(work, struct scull_device,
+						refill);
+	struct scull_pool *pool;
+	unsigned int depth;
+	size_t quantum;
+	void *data;
+	int cpu, idx;
+	bool full;
+
+	idx = srcu_read_lock(&dev->srcu);
+	quantum = srcu_dereference(dev->data, &dev->srcu)->quantum;
+	srcu_read_unlock(&dev->srcu, idx);
+	depth = scull_pool_depth(quantum);
+	for_each_possible_cpu(cpu) {
+		pool = per_cpu_ptr(dev->pool, cpu);
+		if (!READ_ONCE(pool->want))
+			continue;
+		scull_pool_drain(pool, quantum);
+		for (full = false; !full;) {
+			if (READ_ONCE(dev->numa_policy) == SCULL_NUMA_LOCAL)
+				data = scull_alloc_node(dev, quantum,
+							cpu_to_node(cpu));
+			else
+				data = scull_alloc_node(dev, quantum,
+							scull_nid(dev));
+			if (!data)
+				break;
+			spin_lock(&pool->lock);
+			if (pool->quantum == quantum && pool->nr < depth) {
+				pool->quanta[pool->nr++] = data;
+				data = NULL;
+			}
+			full = pool->nr >= depth;
+			spin_unlock(&pool->lock);
+			if (data) {
+				scull_free_quantum(data, quantum);
+				break;
+			}
+		}
+		WRITE_ONCE(pool->want, false);
+		cond_resched();
+	}
+}
+
+/* scull_alloc_quantum() returns a zeroed quantum, from the local pool
+ * when it can. */
+static void *scull_alloc_quantum(struct scull_device *dev, size_t quantum)
+{
+	u64 start = ktime_get_ns();
+	void *data;
+
+	data = scull_pool_get(dev, quantum);
+	if (!data)
+		data = scull_alloc_node(dev, quantum, scull_nid(dev));
+	if (data)
+		scull_account(dev, SCULL_STAT_ALLOC, quantum, start);
+	return data;
+}
+
+static inline bool scull_is_zquantum(const void *data)
+{
+	return (unsigned long)data&SCULL_ZQUANTUM;
+}
+
+static inline struct scull_zquantum *scull_zquantum(void *data)
+{
+	return (struct scull_zquantum *)((unsigned long)data&~SCULL_ZQUANTUM);
+}
+
+static inline bool scull_is_shared(const void *data)
+{
+	return (unsigned long)data&SCULL_SHARED;
+}
+
+static inline struct scull_shared *scull_shared(void *data)
+{
+	return (struct scull_shared *)((unsigned long)data&~SCULL_SHARED);
+}
+
+/* scull_raw() returns the quantum behind the shared one. */
+static inline void *scull_raw(void *data)
+{
+	if (scull_is_shared(data))
+		return READ_ONCE(scull_shared(data)->data);
+	return data;
+}
+
+/* scull_resident() accounts the raw or shared quantum into, or out of,
+ * a slot on the node of its page. */
+static void scull_resident(struct scull_device *dev, void *data, long nr)
+{
+	struct page *page = scull_quantum_page(scull_raw(data));
+
+	atomic_long_add(nr, &dev->numa_resident[page_to_nid(page)]);
+}
+
+/* scull_put_quantum() drops the reference to the raw or shared quantum. */
+static void scull_put_quantum(void *data, size_t quantum)
+{
+	struct scull_shared *sh;
+
+	if (!scull_is_shared(data)) {
+		scull_free_quantum(data, quantum);
+		return;
+	}
+	sh = scull_shared(data);
+	if (!refcount_dec_and_test(&sh->ref))
+		return;
+	scull_free_quantum(sh->data, quantum);
+	kfree(sh);
+}
+
+static void scull_qfree_rcu(struct rcu_head *rcu)
+{
+	struct scull_qfree *qf = container_of(rcu, struct scull_qfree, rcu);
+	scull_put_quantum(qf->data, qf->quantum);
+	kfree(qf);
+}
+
+static void scull_shared_free_rcu(struct rcu_head *rcu)
+{
+	kfree(container_of(rcu, struct scull_shared, rcu));
+}
+
+/* quanta mapped by mmap(2) or sitting in a pipe should stay put */
+static bool scull_quantum_busy(struct scull_data *sd, void *data)
+{
+	struct page *page;
+	size_t off;
+
+	if (sd->quantum < PAGE_SIZE)
+		return false;
+	if (!is_vmalloc_addr(data))
+		return page_count(virt_to_head_page(data)) != 1;
+	for (off = 0; off < sd->quantum; off += PAGE_SIZE) {
+		page = vmalloc_to_page(data+off);
+		if (page_count(page) != 1)
+			return true;
+	}
+	return false;
+}
+
+/* scull_free_slot() frees the quantum in the slot of the data going
+ * away, recycling the raw one into the pool. */
+static void scull_free_slot(struct scull_data *sd, void *data)
+{
+	if (scull_is_zquantum(data)) {
+		kfree(scull_zquantum(data));
+		return;
+	}
+	scull_resident(sd->dev, data, -1);
+	if (scull_is_shared(data) || scull_quantum_busy(sd, data) ||
+		 !scull_recycle(sd->dev, sd->quantum, data, true))
+		scull_put_quantum(data, sd->quantum);
+}
+
+/* scull_deflate() compresses the quantum in the slot, and frees the raw
+ * one after the SRCU grace period.  The caller holds the qset lock stripe
+ * for writing, and nothing blocks in the reclaim context. */
+static bool scull_deflate(struct scull_device *dev, struct scull_data *sd,
+			  void **slot, bool reclaim)
+{
+	gfp_t gfp = reclaim ? GFP_NOWAIT|__GFP_NOWARN : GFP_KERNEL;
+	struct scull_driver *drv = &scull_driver;
+	struct scull_zquantum *zq = NULL;
+	unsigned int len = sd->quantum;
+	struct scull_qfree *qf;
+	void *data = *slot;
+	int err;
+
+	if (!data || scull_is_zquantum(data) || scull_is_shared(data))
+		return false;
+	if (scull_quantum_busy(sd, data))
+		return false;
+	qf = kmalloc(sizeof(struct scull_qfree), gfp);
+	if (!qf)
+		return false;
+	if (!reclaim)
+		mutex_lock(&drv->zlock);
+	else if (!mutex_trylock(&drv->zlock))
+		goto free;
+	err = crypto_comp_compress(drv->tfm, data, sd->quantum, drv->zbuf, &len);
+	/* not worth it, unless it saves a quarter of the quantum */
+	if (!err && len <= sd->quantum-sd->quantum/4) {
+		zq = kmalloc(sizeof(struct scull_zquantum)+len, gfp);
+		if (zq) {
+			zq->len = len;
+			memcpy(zq->data, drv->zbuf, len);
+		}
+	}
+	mutex_unlock(&drv->zlock);
+	if (!zq)
+		goto free;
+	smp_store_release(slot, (void *)((unsigned long)zq|SCULL_ZQUANTUM));
+	atomic_long_dec(&sd->nr_quanta);
+	scull_resident(dev, data, -1);
+	atomic_long_add(len, &sd->zbytes);
+	atomic_long_add(sd->quantum, &sd->zorig);
+	qf->data = data;
+	qf->quantum = sd->quantum;
+	call_srcu(&dev->srcu, &qf->rcu, scull_qfree_rcu);
+	return true;
+free:
+	kfree(qf);
+	return false;
+}
+
+/* scull_unzip() decompresses the compressed quantum into buf, leaving
+ * it as it is. */
+static int scull_unzip(struct scull_data *sd, struct scull_zquantum *zq,
+		       void *buf)
+{
+	struct scull_driver *drv = &scull_driver;
+	unsigned int len = sd->quantum;
+	struct scull_zstrm *zs;
+	int err;
+
+	zs = raw_cpu_ptr(drv->zstrm);
+	mutex_lock(&zs->lock);
+	err = crypto_comp_decompress(zs->tfm, zq->data, zq->len, buf, &len);
+	mutex_unlock(&zs->lock);
+	if (WARN_ON_ONCE(err || len != sd->quantum))
+		return -EIO;
+	return 0;
+}
+
+/* scull_decompress() restores the compressed quantum in the slot.
+ * The caller holds the qset lock stripe for writing. */
+static void *scull_decompress(struct scull_device *dev, struct scull_data *sd,
+			      void **slot)
+{
+	struct scull_zquantum *zq = scull_zquantum(*slot);
+	void *data;
+	u64 start;
+
+	data = scull_alloc_quantum(dev, sd->quantum);
+	if (!data)
+		return NULL;
+	start = ktime_get_ns();
+	if (scull_unzip(sd, zq, data)) {
+		scull_free_quantum(data, sd->quantum);
+		return NULL;
+	}
+	atomic64_add(ktime_get_ns()-start, &dev->decompress_ns);
+	atomic64_inc(&dev->decompress_nr);
+	atomic_long_inc(&sd->nr_quanta);
+	scull_resident(dev, data, 1);
+	atomic_long_sub(zq->len, &sd->zbytes);
+	atomic_long_sub(sd->quantum, &sd->zorig);
+	smp_store_release(slot, data);
+	kfree(zq);
+	return data;
+}
+
+/* scull_unshare() copies the shared quantum in the slot for the writer,
+ * or takes it back when the slot holds the last reference.  The caller
+ * holds the qset lock stripe for writing. */
+static void *scull_unshare(struct scull_device *dev, struct scull_data *sd,
+			   void **slot)
+{
+	struct scull_shared *sh = scull_shared(*slot);
+	struct scull_qfree *qf;
+	void *data;
+
+	if (refcount_read(&sh->ref) == 1) {
+		data = sh->data;
+		WRITE_ONCE(*slot, data);
+		/* the lockless readers could still be on the wrapper */
+		call_srcu(&dev->srcu, &sh->rcu, scull_shared_free_rcu);
+		return data;
+	}
+	qf = kmalloc(sizeof(struct scull_qfree), GFP_KERNEL);
+	if (!qf)
+		return ERR_PTR(-ENOMEM);
+	data = scull_alloc_quantum(dev, sd->quantum);
+	if (!data) {
+		kfree(qf);
+		return ERR_PTR(-ENOMEM);
+	}
+	memcpy(data, sh->data, sd->quantum);
+	smp_store_release(slot, data);
+	scull_resident(dev, sh->data, -1);
+	scull_resident(dev, data, 1);
+	qf->data = (void *)((unsigned long)sh|SCULL_SHARED);
+	qf->quantum = sd->quantum;
+	call_srcu(&dev->srcu, &qf->rcu, scull_qfree_rcu);
+	return data;
+}
+
+/* scull_writable() returns the quantum in the slot as a raw and private
+ * one for the writer, or NULL for a hole.  The caller holds the qset lock
+ * stripe for writing. */
+static void *scull_writable(struct scull_device *dev, struct scull_data *sd,
+			    void **slot)
+{
+	void *data = *slot;
+
+	if (scull_is_zquantum(data)) {
+		data = scull_decompress(dev, sd, slot);
+		return data ? data : ERR_PTR(-ENOMEM);
+	}
+	if (scull_is_shared(data))
+		return scull_unshare(dev, sd, slot);
+	return data;
+}
+
+static struct scull_data *scull_alloc_data(struct scull_device *dev,
+					   size_t qset, size_t quantum)
+{
+	struct scull_data *sd;
+
+	sd = kmalloc(sizeof(struct scull_data), GFP_KERNEL);
+	if (!sd)
+		return NULL;
+	xa_init(&sd->qsets);
+	sd->dev = dev;
+	sd->qset = qset;
+	sd->quantum = quantum;
+	atomic_long_set(&sd->nr_quanta, 0);
+	atomic_long_set(&sd->zbytes, 0);
+	atomic_long_set(&sd->zorig, 0);
+	/* no qsets until the data outgrows it */
+	sd->inlined = quantum > SCULL_INLINE_MAX;
+	memset(sd->idata, 0, sizeof(sd->idata));
+	sd->restore = NULL;
+	return sd;
+}
+
+static void scull_free_data(struct scull_data *sd)
+{
+	struct scull_qset *qset;
+	unsigned long index;
+	int i;
+
+	xa_for_each(&sd->qsets, index, qset) {
+		for (i = 0; i < qset->cap && qset->nr; i++)
+			if (qset->data[i]) {
+				scull_free_slot(sd, qset->data[i]);
+				qset->nr--;
+			}
+		WARN_ON_ONCE(qset->nr);
+		kfree(qset);
+		cond_resched();
+	}
+	xa_destroy(&sd->qsets);
+	kvfree(sd->restore);
+	kfree(sd);
+}
+
+static void scull_free_data_work(struct work_struct *work)
+{
+	struct scull_data *sd = container_of(work, struct scull_data, free);
+	struct scull_device *dev = sd->dev;
+	long pending = sd->pending;
+
+	scull_free_data(sd);
+	atomic_long_sub(pending, &dev->pending_free);
+}
+
+static void scull_free_data_rcu(struct rcu_head *rcu)
+{
+	struct scull_data *sd = container_of(rcu, struct scull_data, rcu);
+
+	/* too much for the softirq context */
+	queue_work(scull_driver.wq, &sd->free);
+}
+
+/* scull_trim() replaces the data with an empty one of the given geometry,
+ * and leaves the old one to the workqueue once the lockless readers are
+ * done with it. */
+static int scull_trim(struct scull_device *dev, size_t qset, size_t quantum)
+{
+	u64 start = ktime_get_ns();
+	struct scull_data *sd, *old;
+
+	sd = scull_alloc_data(dev, qset, quantum);
+	if (!sd)
+		return -ENOMEM;
+	old = rcu_dereference_protected(dev->data, lockdep_is_held(&dev->lock));
+	rcu_assign_pointer(dev->data, sd);
+	dev->size = 0;
+	old->pending = atomic_long_read(&old->nr_quanta)*old->quantum;
+	old->pending += atomic_long_read(&old->zbytes);
+	atomic_long_add(old->pending, &dev->pending_free);
+	INIT_WORK(&old->free, scull_free_data_work);
+	call_srcu(&dev->srcu, &old->rcu, scull_free_data_rcu);
+	scull_account(dev, SCULL_STAT_TRIM, old->pending, start);
+	return 0;
+}
+
+/* scull_down_read() and scull_down_write() take dev->lock, accounting the
+ * time spent waiting on it. */
+static int scull_down_read(struct scull_device *dev)
+{
+	u64 start = ktime_get_ns();
+
+	if (down_read_killable(&dev->lock))
+		return -ERESTARTSYS;
+	scull_account(dev, SCULL_STAT_LOCK, 0, start);
+	return 0;
+}
+
+static int scull_down_write(struct scull_device *dev)
+{
+	u64 start = ktime_get_ns();
+
+	if (down_write_killable(&dev->lock))
+		return -ERESTARTSYS;
+	scull_account(dev, SCULL_STAT_LOCK, 0, start);
+	return 0;
+}
+
+/* scull_qset_down_read() and scull_qset_down_write() take a qset lock
+ * stripe, accounting the time spent waiting on it when contended. */
+static void scull_qset_down_read(struct scull_device *dev,
+				 struct rw_semaphore *lock)
+{
+	u64 start;
+
+	if (down_read_trylock(lock))
+		return;
+	start = ktime_get_ns();
+	down_read(lock);
+	scull_account(dev, SCULL_STAT_LOCK, 0, start);
+}
+
+static void scull_qset_down_write(struct scull_device *dev,
+				  struct rw_semaphore *lock)
+{
+	u64 start;
+
+	if (down_write_trylock(lock))
+		return;
+	start = ktime_get_ns();
+	down_write(lock);
+	scull_account(dev, SCULL_STAT_LOCK, 0, start);
+}
+
+/* scull_locked_data() returns the device data for the dev->lock holders. */
+static struct scull_data *scull_locked_data(struct scull_device *dev)
+{
+	return rcu_dereference_protected(dev->data, lockdep_is_held(&dev->lock));
+}
+
+static inline void scull_touch(struct scull_qset *qset)
+{
+	/* avoid dirtying the cacheline more than once a tick */
+	if (READ_ONCE(qset->atime) != jiffies)
+		WRITE_ONCE(qset->atime, jiffies);
+}
+
+static void scull_qset_free_rcu(struct rcu_head *rcu)
+{
+	kfree(container_of(rcu, struct scull_qset, rcu));
+}
+
+/* scull_follow() returns the qset covering pos, allocating it or growing
+ * it to cover pos on demand.  The caller holds the qset lock stripe for
+ * writing. */
+static struct scull_qset *scull_follow(struct scull_data *sd, loff_t pos)
+{
+	unsigned long index = pos/(sd->quantum*sd->qset);
+	size_t i = pos%(sd->qset*sd->quantum)/sd->quantum;
+	struct scull_qset *qset, *old;
+	size_t cap;
+	int err;
+
+	old = xa_load(&sd->qsets, index);
+	if (old && i < old->cap) {
+		qset = old;
+		goto out;
+	}
+	cap = clamp_t(size_t, roundup_pow_of_two(i+1), SCULL_QSET_MIN, sd->qset);
+	qset = kzalloc(sizeof(struct scull_qset)+sizeof(void *)*cap, GFP_KERNEL);
+	if (!qset)
+		return NULL;
+	qset->cap = cap;
+	if (old) {
+		qset->nr = old->nr;
+		memcpy(qset->data, old->data, sizeof(void *)*old->cap);
+	}
+	err = xa_err(xa_store(&sd->qsets, index, qset, GFP_KERNEL));
+	if (err) {
+		kfree(qset);
+		return NULL;
+	}
+	/* the lockless readers could still be on the old one */
+	if (old)
+		call_srcu(&sd->dev->srcu, &old->rcu, scull_qset_free_rcu);
+out:
+	scull_touch(qset);
+	return qset;
+}
+
+/* scull_qset_lock() returns the lock stripe protecting the qset covering pos. */
+static struct rw_semaphore *scull_qset_lock(struct scull_device *dev,
+					    struct scull_data *sd, loff_t pos)
+{
+	return &dev->locks[pos/(sd->quantum*sd->qset)%SCULL_NR_LOCKS];
+}
+
+static void scull_extend(struct scull_device *dev, loff_t pos)
+{
+	spin_lock(&dev->size_lock);
+	if (dev->size < pos)
+		dev->size = pos;
+	spin_unlock(&dev->size_lock);
+}
+
+/* scull_slot() returns the slot covering pos, or NULL beyond what the
+ * qset has grown to. */
+static inline void **scull_slot(struct scull_data *sd,
+				struct scull_qset *qset, loff_t pos)
+{
+	size_t i = pos%(sd->qset*sd->quantum)/sd->quantum;
+
+	return i < qset->cap ? &qset->data[i] : NULL;
+}
+
+/* scull_pending() tells whether the quantum covering pos is still left
+ * in the backing file. */
+static inline bool scull_pending(struct scull_data *sd, loff_t pos)
+{
+	struct scull_restore *r = sd->restore;
+	unsigned long i = pos/sd->quantum;
+
+	if (!r || i >= r->nr)
+		return false;
+	if (!test_bit(i, r->done))
+		return true;
+	/* pairs with scull_restored(), for the restored slot */
+	smp_rmb();
+	return false;
+}
+
+/* scull_restored() marks the quantum covering pos as no longer in the
+ * backing file, after the slot is published. */
+static void scull_restored(struct scull_data *sd, loff_t pos)
+{
+	struct scull_restore *r = sd->restore;
+	unsigned long i = pos/sd->quantum;
+
+	if (!r || i >= r->nr)
+		return;
+	/* fully ordered */
+	if (!test_and_set_bit(i, r->done))
+		atomic_long_dec(&r->left);
+}
+
+/* scull_lookup() returns the quantum covering pos, or NULL for a hole.
+ * It is the inline data up to SCULL_INLINE_MAX for the small one.  The
+ * sealed data is never compressed, and its qsets are left untouched. */
+static void *scull_lookup(struct scull_data *sd, loff_t pos, bool touch)
+{
+	struct scull_qset *qset;
+	void **slot;
+
+	if (pos < SCULL_INLINE_MAX && smp_load_acquire(&sd->inlined))
+		return sd->idata;
+	qset = xa_load(&sd->qsets, pos/(sd->quantum*sd->qset));
+	if (!qset)
+		return NULL;
+	if (touch)
+		scull_touch(qset);
+	slot = scull_slot(sd, qset, pos);
+	return slot ? scull_raw(READ_ONCE(*slot)) : NULL;
+}
+
+static inline bool scull_is_inline(struct scull_data *sd, const void *data)
+{
+	return data >= (void *)sd->idata &&
+		data < (void *)sd->idata+SCULL_INLINE_MAX;
+}
+
+/* scull_seek() returns the first data, or hole, position at or after pos. */
+static loff_t scull_seek(struct scull_data *sd, size_t size, loff_t pos,
+			 int whence)
+{
+	struct scull_restore *r = sd->restore;
+	loff_t qsize = sd->quantum*sd->qset;
+	struct scull_qset *qset;
+	unsigned long index;
+	size_t i;
+
+	/* the small data is all data */
+	if (READ_ONCE(sd->inlined))
+		return whence == SEEK_DATA ? pos : size;
+	/* and so is what is left in the backing file */
+	if (r && atomic_long_read(&r->left) && pos < (loff_t)r->nr*sd->quantum) {
+		if (whence == SEEK_DATA)
+			return pos;
+		pos = (loff_t)r->nr*sd->quantum;
+	}
+	index = pos/qsize;
+	while (pos < size) {
+		if (whence == SEEK_DATA)
+			qset = xa_find(&sd->qsets, &index, ULONG_MAX, XA_PRESENT);
+		else
+			qset = xa_load(&sd->qsets, index);
+		if (!qset)
+			return whence == SEEK_DATA ? -ENXIO : pos;
+		if (pos < index*qsize)
+			pos = index*qsize;
+		for (i = pos%qsize/sd->quantum; i < sd->qset; i++) {
+			if (pos >= size)
+				break;
+			/* beyond the capacity is a hole */
+			if (!(i < qset->cap && READ_ONCE(qset->data[i])) ==
+			    (whence == SEEK_HOLE))
+				return pos;
+			pos = index*qsize+(i+1)*sd->quantum;
+		}
+		index++;
+	}
+	return whence == SEEK_DATA ? -ENXIO : size;
+}
+
+static void scull_install(struct scull_data *sd, struct scull_qset *qset,
+			  void **slot, void *data)
+{
+	/* publish the zeroed quantum to the lockless readers */
+	smp_store_release(slot, data);
+	atomic_long_inc(&sd->nr_quanta);
+	scull_resident(sd->dev, data, 1);
+	qset->nr++;
+}
+
+/* __scull_spill() moves the inline data into the first quantum, leaving
+ * it a hole when it is all zeros.  The caller holds the qset lock stripe
+ * of pos 0 for writing. */
+static int __scull_spill(struct scull_device *dev, struct scull_data *sd)
+{
+	struct scull_qset *qset;
+	void *data;
+
+	if (!sd->inlined)
+		return 0;
+	if (memchr_inv(sd->idata, 0, sizeof(sd->idata))) {
+		qset = scull_follow(sd, 0);
+		if (!qset)
+			return -ENOMEM;
+		data = scull_alloc_quantum(dev, sd->quantum);
+		if (!data)
+			return -ENOMEM;
+		memcpy(data, sd->idata, sizeof(sd->idata));
+		scull_install(sd, qset, &qset->data[0], data);
+	}
+	/* the readers move on to the quanta */
+	smp_store_release(&sd->inlined, false);
+	return 0;
+}
+
+/* scull_spill() switches the data to the full layout, before anything
+ * but the small read and write goes to the qsets. */
+static int scull_spill(struct scull_device *dev, struct scull_data *sd)
+{
+	struct rw_semaphore *lock;
+	int err;
+
+	if (!READ_ONCE(sd->inlined))
+		return 0;
+	lock = scull_qset_lock(dev, sd, 0);
+	scull_qset_down_write(dev, lock);
+	err = __scull_spill(dev, sd);
+	up_write(lock);
+	return err;
+}
+
+/* __scull_restore() reads the quantum covering pos back from the backing
+ * file, unless it is restored or overwritten already.  Zeros stay a hole.
+ * The caller holds the qset lock stripe for writing. */
+static int __scull_restore(struct scull_device *dev, struct scull_data *sd,
+			   loff_t pos)
+{
+	loff_t off = pos-pos%sd->quantum;
+	struct scull_qset *qset;
+	ssize_t ret;
+	void *data;
+
+	if (!scull_pending(sd, pos))
+		return 0;
+	data = scull_alloc_quantum(dev, sd->quantum);
+	if (!data)
+		return -ENOMEM;
+	ret = kernel_read(dev->backing, data, sd->quantum, &off);
+	if (ret > 0 && memchr_inv(data, 0, ret)) {
+		qset = scull_follow(sd, pos);
+		if (!qset) {
+			ret = -ENOMEM;
+			goto free;
+		}
+		scull_install(sd, qset, scull_slot(sd, qset, pos), data);
+		data = NULL;
+	}
+	if (ret >= 0)
+		scull_restored(sd, pos);
+free:
+	if (data && !scull_recycle(dev, sd->quantum, data, ret != 0))
+		scull_free_quantum(data, sd->quantum);
+	return ret < 0 ? ret : 0;
+}
+
+/* scull_restore() restores the quantum covering pos for the lockless
+ * readers, and returns it. */
+static void *scull_restore(struct scull_device *dev, struct scull_data *sd,
+			   loff_t pos)
+{
+	struct rw_semaphore *lock = scull_qset_lock(dev, sd, pos);
+	void *data;
+	int err;
+
+	scull_qset_down_write(dev, lock);
+	err = __scull_restore(dev, sd, pos);
+	data = err ? ERR_PTR(err) : scull_lookup(sd, pos, true);
+	up_write(lock);
+	return data;
+}
+
+/* scull_restore_all() restores everything left in the backing file, for
+ * those walking the qsets.  The caller holds dev->lock for writing. */
+static int scull_restore_all(struct scull_device *dev, struct scull_data *sd)
+{
+	struct scull_restore *r = sd->restore;
+	struct rw_semaphore *lock;
+	unsigned long i;
+	loff_t pos;
+	int err;
+
+	if (!r)
+		return 0;
+	for_each_clear_bit(i, r->done, r->nr) {
+		pos = (loff_t)i*sd->quantum;
+		lock = scull_qset_lock(dev, sd, pos);
+		scull_qset_down_write(dev, lock);
+		err = __scull_restore(dev, sd, pos);
+		up_write(lock);
+		if (err)
+			return err;
+		cond_resched();
+	}
+	return 0;
+}
+
+/* scull_release() turns the slot back into a hole, and returns false
+ * when the quantum is mapped and has to stay.  The caller holds the qset
+ * lock stripe for writing. */
+static bool scull_release(struct scull_device *dev, struct scull_data *sd,
+			  struct scull_qset *qset, void **slot)
+{
+	struct scull_qfree *qf;
+	void *data = *slot;
+
+	if (!data)
+		return true;
+	if (scull_is_zquantum(data)) {
+		/* the lockless readers never dereference this one */
+		WRITE_ONCE(*slot, NULL);
+		atomic_long_sub(scull_zquantum(data)->len, &sd->zbytes);
+		atomic_long_sub(sd->quantum, &sd->zorig);
+		kfree(scull_zquantum(data));
+	} else {
+		if (!scull_is_shared(data) && scull_quantum_busy(sd, data))
+			return false;
+		qf = kmalloc(sizeof(struct scull_qfree), GFP_KERNEL);
+		if (!qf)
+			return false;
+		WRITE_ONCE(*slot, NULL);
+		atomic_long_dec(&sd->nr_quanta);
+		scull_resident(dev, data, -1);
+		qf->data = data;
+		qf->quantum = sd->quantum;
+		call_srcu(&dev->srcu, &qf->rcu, scull_qfree_rcu);
+	}
+	qset->nr--;
+	return true;
+}
+
+/* scull_quantum() returns the quantum covering pos, allocating or
+ * decompressing it on demand.  The caller holds the qset lock stripe
+ * for writing. */
+static void *scull_quantum(struct scull_device *dev, struct scull_data *sd,
+			   loff_t pos)
+{
+	struct scull_qset *qset;
+	void **slot, *data;
+
+	if (__scull_restore(dev, sd, pos))
+		return NULL;
+	qset = scull_follow(sd, pos);
+	if (!qset)
+		return NULL;
+	slot = scull_slot(sd, qset, pos);
+	data = scull_writable(dev, sd, slot);
+	if (IS_ERR(data))
+		return NULL;
+	if (!data) {
+		data = scull_alloc_quantum(dev, sd->quantum);
+		if (!data)
+			return NULL;
+		scull_install(sd, qset, slot, data);
+	}
+	return data;
+}
+
+/* scull_punch() zeroes [pos, end) of the quantum covering pos, and turns
+ * it into a hole once it is all zeros.  The caller holds the qset lock
+ * stripe for writing. */
+static int scull_punch(struct scull_device *dev, struct scull_data *sd,
+		       loff_t pos, loff_t end)
+{
+	struct scull_qset *qset;
+	void **slot, *data;
+	size_t dpos, len;
+	int err;
+
+	dpos = pos%sd->quantum;
+	len = min_t(loff_t, sd->quantum-dpos, end-pos);
+	/* the rest of the quantum has to come back from the file */
+	if (len == sd->quantum)
+		scull_restored(sd, pos);
+	else {
+		err = __scull_restore(dev, sd, pos);
+		if (err)
+			return err;
+	}
+	qset = xa_load(&sd->qsets, pos/(sd->quantum*sd->qset));
+	if (!qset)
+		return 0;
+	slot = scull_slot(sd, qset, pos);
+	if (!slot)
+		return 0;
+	if (len == sd->quantum && scull_release(dev, sd, qset, slot))
+		return 0;
+	data = scull_writable(dev, sd, slot);
+	if (IS_ERR(data))
+		return PTR_ERR(data);
+	if (!data)
+		return 0;
+	memset(data+dpos, 0, len);
+	if (!memchr_inv(data, 0, sd->quantum))
+		scull_release(dev, sd, qset, slot);
+	return 0;
+}
+
+/* scull_inflate() decompresses the quantum covering pos for the lockless
+ * readers, and returns it.  It could be a hole by now. */
+static void *scull_inflate(struct scull_device *dev, struct scull_data *sd,
+			   loff_t pos)
+{
+	struct rw_semaphore *lock = scull_qset_lock(dev, sd, pos);
+	struct scull_qset *qset;
+	void **slot, *data;
+
+	scull_qset_down_write(dev, lock);
+	/* the reader saw the quantum, and the qset only grows */
+	qset = xa_load(&sd->qsets, pos/(sd->quantum*sd->qset));
+	slot = scull_slot(sd, qset, pos);
+	data = *slot;
+	if (scull_is_zquantum(data)) {
+		data = scull_decompress(dev, sd, slot);
+		if (!data)
+			data = ERR_PTR(-ENOMEM);
+	}
+	up_write(lock);
+	if (IS_ERR(data))
+		return data;
+	return scull_raw(data);
+}
+
+/* scull_compress() compresses up to nr quanta of the qsets idle for
+ * the given jiffies, and returns the number of quanta compressed. */
+static unsigned long scull_compress(struct scull_device *dev,
+				    unsigned long idle, unsigned long nr,
+				    bool reclaim)
+{
+	struct rw_semaphore *lock;
+	struct scull_qset *qset;
+	struct scull_data *sd;
+	unsigned long index;
+	unsigned long done = 0;
+	int i;
+
+	if (!reclaim)
+		down_read(&dev->lock);
+	else if (!down_read_trylock(&dev->lock))
+		return 0;
+	/* the sealed readers count on the raw quanta */
+	if (dev->sealed) {
+		up_read(&dev->lock);
+		return 0;
+	}
+	sd = scull_locked_data(dev);
+	xa_for_each(&sd->qsets, index, qset) {
+		lock = &dev->locks[index%SCULL_NR_LOCKS];
+		if (!reclaim)
+			scull_qset_down_write(dev, lock);
+		else if (!down_write_trylock(lock))
+			continue;
+		/* it could have grown in the meantime */
+		qset = xa_load(&sd->qsets, index);
+		if (time_before(jiffies, READ_ONCE(qset->atime)+idle)) {
+			up_write(lock);
+			continue;
+		}
+		for (i = 0; i < qset->cap && done < nr; i++)
+			if (scull_deflate(dev, sd, &qset->data[i], reclaim))
+				done++;
+		up_write(lock);
+		if (done >= nr)
+			break;
+		if (!reclaim)
+			cond_resched();
+	}
+	up_read(&dev->lock);
+	return done;
+}
+
+static void scull_compress_work(struct work_struct *work)
+{
+	struct scull_device *dev = container_of(to_delayed_work(work),
+						struct scull_device,
+						compress);
+	unsigned long idle = msecs_to_jiffies(READ_ONCE(dev->compress_ms));
+
+	if (!idle)
+		return;
+	scull_compress(dev, idle, ULONG_MAX, false);
+	queue_delayed_work(system_unbound_wq, &dev->compress,
+			   max(idle/2, 1UL));
+}
+
+static unsigned long scull_count_objects(struct shrinker *shrinker,
+					 struct shrink_control *sc)
+{
+	struct scull_driver *drv = container_of(shrinker, struct scull_driver,
+						shrinker);
+	struct scull_node *node, *end = drv->nodes+drv->nr_devs;
+	struct scull_device *dev;
+	unsigned long count = 0;
+	size_t bytes;
+	int idx;
+
+	for (node = drv->nodes; node < end; node++) {
+		dev = smp_load_acquire(&node->dev);
+		if (!dev)
+			continue;
+		count += scull_pooled(dev, &bytes);
+		if (!READ_ONCE(dev->compress_ms) || READ_ONCE(dev->sealed))
+			continue;
+		idx = srcu_read_lock(&dev->srcu);
+		count += atomic_long_read(&srcu_dereference(dev->data,
+							    &dev->srcu)->nr_quanta);
+		srcu_read_unlock(&dev->srcu, idx);
+	}
+	return count;
+}
+
+/* under the memory pressure, free the pooled quanta, and compress
+ * whatever is idle for a second */
+static unsigned long scull_scan_objects(struct shrinker *shrinker,
+					struct shrink_control *sc)
+{
+	struct scull_driver *drv = container_of(shrinker, struct scull_driver,
+						shrinker);
+	struct scull_node *node, *end = drv->nodes+drv->nr_devs;
+	struct scull_device *dev;
+	unsigned long freed = 0;
+
+	for (node = drv->nodes; node < end && freed < sc->nr_to_scan; node++) {
+		dev = smp_load_acquire(&node->dev);
+		if (!dev)
+			continue;
+		freed += scull_drain_pools(dev);
+		if (freed >= sc->nr_to_scan || !READ_ONCE(dev->compress_ms))
+			continue;
+		freed += scull_compress(dev, HZ, sc->nr_to_scan-freed, true);
+	}
+	return freed ? freed : SHRINK_STOP;
+}
+
+/* scull_copy_to_iter() copies page backed quanta page by page, so that
+ * splice(2) takes a reference to the quantum pages instead of a copy. */
+static size_t scull_copy_to_iter(struct scull_data *sd, void *data,
+				 size_t len, struct iov_iter *iter)
+{
+	size_t n, off, copied = 0;
+
+	if (sd->quantum < PAGE_SIZE || scull_is_inline(sd, data))
+		return copy_to_iter(data, len, iter);
+	while (copied < len) {
+		off = offset_in_page(data+copied);
+		n = min_t(size_t, len-copied, PAGE_SIZE-off);
+		n = copy_page_to_iter(scull_quantum_page(data+copied), off, n,
+				      iter);
+		if (!n)
+			break;
+		copied += n;
+	}
+	return copied;
+}
+
+/* holes are read from the zero page, without allocating the quantum */
+static size_t scull_zero_to_iter(size_t len, struct iov_iter *iter)
+{
+	size_t n, copied = 0;
+
+	while (copied < len) {
+		n = min_t(size_t, len-copied, PAGE_SIZE);
+		n = copy_page_to_iter(ZERO_PAGE(0), 0, n, iter);
+		if (!n)
+			break;
+		copied += n;
+	}
+	return copied;
+}
+
+/* scull_read() reads the data at pos, up to size, into the iter, and
+ * returns the bytes read.  The caller is on the SRCU read side. */
+static ssize_t scull_read(struct scull_device *dev, struct scull_data *sd,
+			  size_t size, loff_t pos, struct iov_iter *iter)
+{
+	bool sealed = smp_load_acquire(&dev->sealed);
+	size_t dpos, len, copied;
+	loff_t start = pos;
+	ssize_t ret = 0;
+	void *data;
+
+	while (iov_iter_count(iter) && pos < size) {
+		dpos = pos%sd->quantum;
+		len = min(sd->quantum-dpos, size-(size_t)pos);
+		len = min(len, iov_iter_count(iter));
+		if (scull_pending(sd, pos)) {
+			data = scull_restore(dev, sd, pos);
+			if (IS_ERR(data)) {
+				ret = PTR_ERR(data);
+				break;
+			}
+		} else
+			data = scull_lookup(sd, pos, !sealed);
+		/* the size could be of the data spilled after the lookup */
+		if (data == sd->idata)
+			len = min_t(size_t, len, SCULL_INLINE_MAX-dpos);
+		if (scull_is_zquantum(data)) {
+			data = scull_inflate(dev, sd, pos);
+			if (IS_ERR(data)) {
+				ret = PTR_ERR(data);
+				break;
+			}
+		}
+		if (data)
+			copied = scull_copy_to_iter(sd, data+dpos, len, iter);
+		else
+			copied = scull_zero_to_iter(len, iter);
+		pos += copied;
+		if (copied != len) {
+			ret = -EFAULT;
+			break;
+		}
+	}
+	return pos != start ? pos-start : ret;
+}
+
+ssize_t scull_read_at(struct scull_device *dev, loff_t pos,
+		      struct iov_iter *iter)
+{
+	u64 start = ktime_get_ns();
+	ssize_t ret;
+	int idx;
+
+	/* no lock, the data stays around until we leave the read side */
+	idx = srcu_read_lock(&dev->srcu);
+	ret = scull_read(dev, srcu_dereference(dev->data, &dev->srcu),
+			 READ_ONCE(dev->size), pos, iter);
+	srcu_read_unlock(&dev->srcu, idx);
+	scull_account(dev, SCULL_STAT_READ, max_t(ssize_t, ret, 0), start);
+	return ret;
+}
+EXPORT_SYMBOL(scull_read_at);
+
+static ssize_t read_iter(struct kiocb *cb, struct iov_iter *iter)
+{
+	ssize_t ret;
+
+	ret = scull_read_at(cb->ki_filp->private_data, cb->ki_pos, iter);
+	if (ret > 0)
+		cb->ki_pos += ret;
+	return ret;
+}
+
+/* scull_write() writes the iter at pos, and returns the bytes written,
+ * stopping short at the source not faulted in.  The caller holds
+ * dev->lock for reading. */
+static ssize_t scull_write(struct scull_device *dev, struct scull_data *sd,
+			   loff_t pos, struct iov_iter *iter)
+{
+	struct rw_semaphore *lock, *locked = NULL;
+	void **slot, *data, *spare = NULL;
+	size_t dpos, len, copied;
+	struct scull_qset *qset;
+	loff_t start = pos;
+	ssize_t ret = 0;
+
+	/* the small data goes inline, and the rest spills it */
+	if (READ_ONCE(sd->inlined)) {
+		locked = scull_qset_lock(dev, sd, 0);
+		scull_qset_down_write(dev, locked);
+		if (sd->inlined && pos+iov_iter_count(iter) <= SCULL_INLINE_MAX) {
+			len = iov_iter_count(iter);
+			pagefault_disable();
+			copied = copy_from_iter(sd->idata+pos, len, iter);
+			pagefault_enable();
+			pos += copied;
+			if (copied != len)
+				ret = -EFAULT;
+		} else
+			ret = __scull_spill(dev, sd);
+	}
+	while (!ret && iov_iter_count(iter)) {
+		lock = scull_qset_lock(dev, sd, pos);
+		if (lock != locked) {
+			if (locked)
+				up_write(locked);
+			scull_qset_down_write(dev, lock);
+			locked = lock;
+		}
+		dpos = pos%sd->quantum;
+		len = min(sd->quantum-dpos, iov_iter_count(iter));
+		/* the whole quantum overwritten needs nothing from the file */
+		if (len != sd->quantum) {
+			ret = __scull_restore(dev, sd, pos);
+			if (ret)
+				break;
+		}
+		qset = scull_follow(sd, pos);
+		if (!qset) {
+			ret = -ENOMEM;
+			break;
+		}
+		slot = scull_slot(sd, qset, pos);
+		data = scull_writable(dev, sd, slot);
+		if (IS_ERR(data)) {
+			ret = PTR_ERR(data);
+			break;
+		}
+		/* fill the hole through the spare quantum, which is
+		 * installed only when we write something other than zeros */
+		if (!data) {
+			if (!spare)
+				spare = scull_alloc_quantum(dev, sd->quantum);
+			if (!spare) {
+				ret = -ENOMEM;
+				break;
+			}
+			data = spare;
+		}
+		pagefault_disable();
+		copied = copy_from_iter(data+dpos, len, iter);
+		pagefault_enable();
+		/* the restore skipped above leaves the short copy undone,
+		 * to be tried again as a whole */
+		if (copied != len && len == sd->quantum &&
+		    scull_pending(sd, pos)) {
+			memset(data, 0, copied);
+			iov_iter_revert(iter, copied);
+			copied = 0;
+		}
+		if (data == spare) {
+			if (memchr_inv(spare+dpos, 0, copied)) {
+				scull_install(sd, qset, slot, spare);
+				spare = NULL;
+			}
+		} else if (!memchr_inv(data+dpos, 0, copied) &&
+			   !memchr_inv(data, 0, sd->quantum))
+			scull_release(dev, sd, qset, slot);
+		if (copied == sd->quantum)
+			scull_restored(sd, pos);
+		pos += copied;
+		if (copied != len) {
+			ret = -EFAULT;
+			break;
+		}
+	}
+	if (locked)
+		up_write(locked);
+	/* still zeroed */
+	if (spare && !scull_recycle(dev, sd->quantum, spare, false))
+		scull_free_quantum(spare, sd->quantum);
+	scull_extend(dev, pos);
+	return pos != start ? pos-start : ret;
+}
+
+/* scull_write_locked() writes the whole iter at pos, and returns the
+ * bytes written.  The source could be a mapping of this very device,
+ * whose fault() takes dev->lock and the qset lock, so scull_write()
+ * copies with the page faults disabled, and the short copy drops
+ * dev->lock, held for reading by the caller, to fault the source in
+ * as generic_perform_write() does. */
+static ssize_t scull_write_locked(struct scull_device *dev, loff_t pos,
+				  struct iov_iter *iter)
+{
+	size_t len, done = 0;
+	ssize_t ret = 0;
+
+	while (iov_iter_count(iter)) {
+		ret = scull_write(dev, scull_locked_data(dev), pos+done, iter);
+		if (ret > 0)
+			done += ret;
+		else if (ret != -EFAULT)
+			break;
+		if (!iov_iter_count(iter))
+			break;
+		up_read(&dev->lock);
+		len = iov_iter_count(iter);
+		ret = fault_in_iov_iter_readable(iter, len) == len ? -EFAULT : 0;
+		down_read(&dev->lock);
+		if (ret)
+			break;
+		if (dev->sealed) {
+			ret = -EPERM;
+			break;
+		}
+	}
+	return done ? done : ret;
+}
+
+ssize_t scull_write_at(struct scull_device *dev, loff_t pos,
+		       struct iov_iter *iter)
+{
+	size_t len = iov_iter_count(iter);
+	u64 start = ktime_get_ns();
+	ssize_t ret;
+
+	/* before the locks, not to go through the short copies */
+	if (len && fault_in_iov_iter_readable(iter, len) == len)
+		return -EFAULT;
+	if (scull_down_read(dev))
+		return -ERESTARTSYS;
+	if (dev->sealed)
+		ret = -EPERM;
+	else
+		ret = scull_write_locked(dev, pos, iter);
+	up_read(&dev->lock);
+	scull_account(dev, SCULL_STAT_WRITE, max_t(ssize_t, ret, 0), start);
+	return ret;
+}
+EXPORT_SYMBOL(scull_write_at);
+
+static ssize_t write_iter(struct kiocb *cb, struct iov_iter *iter)
+{
+	ssize_t ret;
+
+	ret = scull_write_at(cb->ki_filp->private_data, cb->ki_pos, iter);
+	if (ret > 0)
+		cb->ki_pos += ret;
+	return ret;
+}
+
+/* scull_ref() returns the quantum in the slot with a new reference for
+ * another slot, turning the raw one into a shared one.  The compressed
+ * one is small enough to be copied.  The caller holds the qset lock
+ * stripe for writing. */
+static void *scull_ref(struct scull_data *sd, void **slot)
+{
+	struct scull_zquantum *zq;
+	struct scull_shared *sh;
+	void *data = *slot;
+
+	if (!data)
+		return NULL;
+	if (scull_is_zquantum(data)) {
+		zq = scull_zquantum(data);
+		zq = kmemdup(zq, sizeof(struct scull_zquantum)+zq->len,
+			     GFP_KERNEL);
+		if (!zq)
+			return ERR_PTR(-ENOMEM);
+		return (void *)((unsigned long)zq|SCULL_ZQUANTUM);
+	}
+	if (scull_is_shared(data)) {
+		refcount_inc(&scull_shared(data)->ref);
+		return data;
+	}
+	/* the mapped one is written behind our back */
+	if (scull_quantum_busy(sd, data))
+		return ERR_PTR(-EBUSY);
+	sh = kmalloc(sizeof(struct scull_shared), GFP_KERNEL);
+	if (!sh)
+		return ERR_PTR(-ENOMEM);
+	refcount_set(&sh->ref, 2);
+	sh->data = data;
+	data = (void *)((unsigned long)sh|SCULL_SHARED);
+	smp_store_release(slot, data);
+	return data;
+}
+
+/* scull_place() replaces the quantum in the slot covering pos with the
+ * one from scull_ref().  The caller holds the qset lock stripe for
+ * writing. */
+static int scull_place(struct scull_device *dev, struct scull_data *sd,
+		       loff_t pos, void *data)
+{
+	struct scull_qset *qset;
+	void **slot;
+
+	qset = scull_follow(sd, pos);
+	if (!qset)
+		return -ENOMEM;
+	slot = scull_slot(sd, qset, pos);
+	if (!scull_release(dev, sd, qset, slot))
+		return -EBUSY;
+	scull_restored(sd, pos);
+	if (!data)
+		return 0;
+	if (!scull_is_zquantum(data)) {
+		scull_install(sd, qset, slot, data);
+		return 0;
+	}
+	WRITE_ONCE(*slot, data);
+	atomic_long_add(scull_zquantum(data)->len, &sd->zbytes);
+	atomic_long_add(sd->quantum, &sd->zorig);
+	qset->nr++;
+	return 0;
+}
+
+/* scull_share() shares the src quantum at spos with dst at dpos.  The
+ * caller holds both device locks. */
+static int scull_share(struct scull_device *src, struct scull_data *ssd,
+		       loff_t spos, struct scull_device *dst,
+		       struct scull_data *dsd, loff_t dpos)
+{
+	struct rw_semaphore *lock;
+	struct scull_qset *qset;
+	void **slot, *data = NULL;
+	int err;
+
+	/* the small src has no whole quantum to share, but the small dst
+	 * has to make room for one */
+	err = scull_spill(dst, dsd);
+	if (err)
+		return err;
+	lock = scull_qset_lock(src, ssd, spos);
+	scull_qset_down_write(src, lock);
+	err = __scull_restore(src, ssd, spos);
+	if (err) {
+		up_write(lock);
+		return err;
+	}
+	qset = xa_load(&ssd->qsets, spos/(ssd->quantum*ssd->qset));
+	slot = qset ? scull_slot(ssd, qset, spos) : NULL;
+	if (slot)
+		data = scull_ref(ssd, slot);
+	up_write(lock);
+	if (IS_ERR(data))
+		return PTR_ERR(data);
+	lock = scull_qset_lock(dst, dsd, dpos);
+	scull_qset_down_write(dst, lock);
+	err = scull_place(dst, dsd, dpos, data);
+	up_write(lock);
+	/* never published, so nobody else is on it */
+	if (err && data)
+		scull_free_slot(dsd, data);
+	return err;
+}
+
+static int scull_lock_pair(struct scull_device *a, struct scull_device *b)
+{
+	if (a > b)
+		swap(a, b);
+	if (scull_down_read(a))
+		return -ERESTARTSYS;
+	if (a != b)
+		down_read_nested(&b->lock, SINGLE_DEPTH_NESTING);
+	return 0;
+}
+
+static void scull_unlock_pair(struct scull_device *a, struct scull_device *b)
+{
+	up_read(&a->lock);
+	if (a != b)
+		up_read(&b->lock);
+}
+
+/* scull_bounce() copies up to n bytes through the buffer, without the
+ * device locks. */
+static ssize_t scull_bounce(struct file *dst_fp, loff_t dpos,
+			    struct file *src_fp, loff_t spos, void *buf,
+			    size_t n)
+{
+	struct kvec kv = {.iov_base = buf, .iov_len = n};
+	struct iov_iter iter;
+	struct kiocb cb;
+	ssize_t ret;
+
+	init_sync_kiocb(&cb, src_fp);
+	cb.ki_pos = spos;
+	iov_iter_kvec(&iter, READ, &kv, 1, n);
+	ret = read_iter(&cb, &iter);
+	if (ret <= 0)
+		return ret;
+	kv.iov_len = ret;
+	init_sync_kiocb(&cb, dst_fp);
+	cb.ki_pos = dpos;
+	iov_iter_kvec(&iter, WRITE, &kv, 1, ret);
+	return write_iter(&cb, &iter);
+}
+
+/* scull_copy() copies len bytes, up to the end of src, by sharing the
+ * whole quanta when the geometry allows, and through a buffer otherwise.
+ * remap insists on sharing, except for the tail at the end of src. */
+static long scull_copy(struct file *dst_fp, loff_t dpos, struct file *src_fp,
+		       loff_t spos, size_t len, bool remap)
+{
+	struct scull_device *dst = dst_fp->private_data;
+	struct scull_device *src = src_fp->private_data;
+	struct scull_data *ssd, *dsd;
+	size_t done = 0, size, q;
+	void *buf = NULL;
+	long ret = 0;
+	ssize_t n;
+
+	if (scull_lock_pair(src, dst))
+		return -ERESTARTSYS;
+	ssd = scull_locked_data(src);
+	dsd = scull_locked_data(dst);
+	q = ssd->quantum;
+	size = READ_ONCE(src->size);
+	if (spos >= size)
+		len = 0;
+	else if (!len || len > size-spos)
+		len = size-spos;
+	/* nor beyond the largest offset of dst */
+	if (len > LLONG_MAX-dpos) {
+		ret = -EINVAL;
+		goto unlock;
+	}
+	if (remap && (q != dsd->quantum || spos%q || dpos%q ||
+		      (len%q && spos+len != size))) {
+		ret = -EINVAL;
+		goto unlock;
+	}
+	while (done < len) {
+		/* it could have been sealed while unlocked */
+		if (dst->sealed) {
+			ret = -EPERM;
+			goto unlock;
+		}
+		ssd = scull_locked_data(src);
+		dsd = scull_locked_data(dst);
+		q = ssd->quantum;
+		while (len-done >= q && q == dsd->quantum &&
+		       !((spos+done)%q) && !((dpos+done)%q)) {
+			ret = scull_share(src, ssd, spos+done, dst, dsd,
+					  dpos+done);
+			if (ret)
+				break;
+			done += q;
+			if (fatal_signal_pending(current)) {
+				ret = -EINTR;
+				break;
+			}
+			cond_resched();
+		}
+		if (done)
+			scull_extend(dst, dpos+done);
+		scull_unlock_pair(src, dst);
+		/* the mapped quanta go through the buffer */
+		if (ret && ret != -EBUSY)
+			goto out;
+		ret = 0;
+		if (done == len)
+			goto out;
+		if (!buf)
+			buf = kmalloc(PAGE_SIZE, GFP_KERNEL);
+		if (!buf) {
+			ret = -ENOMEM;
+			goto out;
+		}
+		n = min_t(size_t, len-done, PAGE_SIZE);
+		n = min_t(size_t, n, q-(spos+done)%q);
+		n = scull_bounce(dst_fp, dpos+done, src_fp, spos+done, buf, n);
+		if (n <= 0) {
+			ret = n;
+			goto out;
+		}
+		done += n;
+		if (scull_lock_pair(src, dst)) {
+			ret = -ERESTARTSYS;
+			goto out;
+		}
+	}
+unlock:
+	scull_unlock_pair(src, dst);
+out:
+	kfree(buf);
+	return done ? done : ret;
+}
+
+/* scull_freeze_qset() copies the qset at index into the snapshot, with
+ * the quanta of it still left in the backing file.  The caller holds the
+ * qset lock stripe of index for writing. */
+static int scull_freeze_qset(struct scull_device *dev, struct scull_data *sd,
+			     struct scull_data *snap, unsigned long index)
+{
+	unsigned long i, first = index*sd->qset, end;
+	struct scull_restore *r = sd->restore;
+	struct scull_qset *qset, *copy;
+	void *data;
+	int err;
+
+	if (r) {
+		end = min_t(unsigned long, first+sd->qset, r->nr);
+		for (i = first; i < end; i++)
+			if (!test_bit(i, r->done)) {
+				clear_bit(i, snap->restore->done);
+				atomic_long_inc(&snap->restore->left);
+			}
+	}
+	qset = xa_load(&sd->qsets, index);
+	if (!qset)
+		return 0;
+	copy = kzalloc(sizeof(struct scull_qset)+sizeof(void *)*qset->cap,
+		       GFP_KERNEL);
+	if (!copy)
+		return -ENOMEM;
+	copy->cap = qset->cap;
+	err = xa_err(xa_store(&snap->qsets, index, copy, GFP_KERNEL));
+	if (err) {
+		kfree(copy);
+		return err;
+	}
+	for (i = 0; i < qset->cap; i++) {
+		data = scull_ref(sd, &qset->data[i]);
+		/* the mapped one is copied as it is now */
+		if (data == ERR_PTR(-EBUSY)) {
+			data = scull_alloc_quantum(dev, sd->quantum);
+			if (data)
+				memcpy(data, qset->data[i], sd->quantum);
+			else
+				data = ERR_PTR(-ENOMEM);
+		}
+		if (IS_ERR(data))
+			return PTR_ERR(data);
+		if (data) {
+			copy->data[i] = data;
+			copy->nr++;
+			if (!scull_is_zquantum(data))
+				scull_resident(dev, data, 1);
+		}
+	}
+	return 0;
+}
+
+/* scull_freeze() copies the qset index of the device up to size, sharing
+ * all the quanta with it.  The caller holds dev->lock for writing, so the
+ * writers wait only for the index walk, not for the data, and the copy
+ * is the device at a single point.  The qset lock stripes are taken in
+ * turn against the lockless readers decompressing in place.  What is
+ * left in the backing file stays there, for the snapshot to restore on
+ * demand. */
+static struct scull_data *scull_freeze(struct scull_device *dev, size_t size)
+{
+	struct scull_data *snap, *sd = scull_locked_data(dev);
+	struct scull_restore *r = sd->restore;
+	unsigned long index, last;
+	struct rw_semaphore *lock;
+	int err = 0;
+
+	snap = scull_alloc_data(dev, sd->qset, sd->quantum);
+	if (!snap)
+		return ERR_PTR(-ENOMEM);
+	if (r) {
+		snap->restore = kvmalloc(struct_size(r, done,
+						     BITS_TO_LONGS(r->nr)),
+					 GFP_KERNEL);
+		if (!snap->restore) {
+			err = -ENOMEM;
+			goto out;
+		}
+		snap->restore->nr = r->nr;
+		atomic_long_set(&snap->restore->left, 0);
+		bitmap_fill(snap->restore->done, r->nr);
+	}
+	last = size ? (size-1)/(sd->qset*sd->quantum) : 0;
+	for (index = 0; !err && index <= last; index++) {
+		/* the lockless readers still decompress in place */
+		lock = &dev->locks[index%SCULL_NR_LOCKS];
+		scull_qset_down_write(dev, lock);
+		if (!index) {
+			snap->inlined = sd->inlined;
+			memcpy(snap->idata, sd->idata, sizeof(sd->idata));
+		}
+		err = scull_freeze_qset(dev, sd, snap, index);
+		up_write(lock);
+		cond_resched();
+	}
+	/* nothing left in the backing file for it */
+	if (!err && r && !atomic_long_read(&snap->restore->left)) {
+		kvfree(snap->restore);
+		snap->restore = NULL;
+	}
+out:
+	if (err) {
+		scull_free_data(snap);
+		return ERR_PTR(err);
+	}
+	return snap;
+}
+
+static void snap_free(struct scull_snap *snap)
+{
+	struct scull_device *dev = snap->sd->dev;
+
+	if (!list_empty(&snap->node)) {
+		mutex_lock(&dev->snaps_lock);
+		list_del(&snap->node);
+		mutex_unlock(&dev->snaps_lock);
+	}
+	scull_free_data(snap->sd);
+	kvfree(snap->buf);
+	kfree(snap);
+}
+
+/* scull_snapshot() returns the file descriptor of the new snapshot. */
+static int scull_snapshot(struct file *fp)
+{
+	struct scull_device *dev = fp->private_data;
+	struct scull_snap *snap;
+	struct scull_data *sd;
+	int fd;
+
+	if (!(fp->f_mode&FMODE_READ))
+		return -EBADF;
+	snap = kzalloc(sizeof(struct scull_snap), GFP_KERNEL);
+	if (!snap)
+		return -ENOMEM;
+	mutex_init(&snap->lock);
+	INIT_LIST_HEAD(&snap->node);
+	if (scull_down_write(dev)) {
+		kfree(snap);
+		return -ERESTARTSYS;
+	}
+	snap->size = dev->size;
+	sd = scull_freeze(dev, snap->size);
+	if (IS_ERR(sd)) {
+		up_write(&dev->lock);
+		kfree(snap);
+		return PTR_ERR(sd);
+	}
+	snap->sd = sd;
+	/* before scull_persist() could write over what it restores */
+	if (sd->restore) {
+		mutex_lock(&dev->snaps_lock);
+		list_add(&snap->node, &dev->snaps);
+		mutex_unlock(&dev->snaps_lock);
+	}
+	up_write(&dev->lock);
+	fd = anon_inode_getfd("[scull-snapshot]", &scull_driver.snap_fops, snap,
+			      O_RDONLY|O_CLOEXEC);
+	if (fd < 0)
+		snap_free(snap);
+	return fd;
+}
+
+static ssize_t snap_read_iter(struct kiocb *cb, struct iov_iter *iter)
+{
+	struct scull_snap *snap = cb->ki_filp->private_data;
+	struct scull_data *sd = snap->sd;
+	loff_t pos = cb->ki_pos;
+	size_t dpos, len, copied;
+	ssize_t ret = 0;
+	void *data;
+
+	if (mutex_lock_interruptible(&snap->lock))
+		return -ERESTARTSYS;
+	while (iov_iter_count(iter) && pos < snap->size) {
+		dpos = pos%sd->quantum;
+		len = min(sd->quantum-dpos, snap->size-(size_t)pos);
+		len = min(len, iov_iter_count(iter));
+		ret = __scull_restore(sd->dev, sd, pos);
+		if (ret)
+			break;
+		data = scull_lookup(sd, pos, true);
+		if (!data) {
+			copied = scull_zero_to_iter(len, iter);
+		} else if (!scull_is_zquantum(data)) {
+			copied = scull_copy_to_iter(sd, data+dpos, len, iter);
+		} else {
+			/* the snapshot is immutable, so decompress aside */
+			if (!snap->buf)
+				snap->buf = kvmalloc(sd->quantum, GFP_KERNEL);
+			if (!snap->buf) {
+				ret = -ENOMEM;
+				break;
+			}
+			ret = scull_unzip(sd, scull_zquantum(data), snap->buf);
+			if (ret)
+				break;
+			copied = copy_to_iter(snap->buf+dpos, len, iter);
+		}
+		pos += copied;
+		if (copied != len) {
+			ret = -EFAULT;
+			break;
+		}
+	}
+	mutex_unlock(&snap->lock);
+	if (pos != cb->ki_pos)
+		ret = pos-cb->ki_pos;
+	cb->ki_pos = pos;
+	return ret;
+}
+
+static loff_t snap_llseek(struct file *fp, loff_t offset, int whence)
+{
+	struct scull_snap *snap = fp->private_data;
+	return fixed_size_llseek(fp, offset, whence, snap->size);
+}
+
+static int snap_release(struct inode *ip, struct file *fp)
+{
+	snap_free(fp->private_data);
+	return 0;
+}
+
+/* scull_batch() does the records of SCULL_IOC_READV or SCULL_IOC_WRITEV
+ * on a single SRCU read side or dev->lock acquisition, and returns the
+ * number of records done, with the result of each in it. */
+static long scull_batch(struct file *fp, unsigned int cmd,
+			struct scull_batch __user *ubatch)
+{
+	struct scull_device *dev = fp->private_data;
+	bool write = cmd == SCULL_IOC_WRITEV;
+	u64 start = ktime_get_ns();
+	struct scull_batch batch;
+	struct scull_rec *recs, *rec;
+	struct scull_data *sd = NULL;
+	struct iov_iter iter;
+	struct iovec iov;
+	size_t bytes = 0, size;
+	int idx = 0;
+	long ret;
+	u32 i;
+
+	if (copy_from_user(&batch, ubatch, sizeof(batch)))
+		return -EFAULT;
+	if (batch.flags || batch.nr > SCULL_BATCH_MAX)
+		return -EINVAL;
+	if (!(fp->f_mode&(write ? FMODE_WRITE : FMODE_READ)))
+		return -EBADF;
+	recs = memdup_user(u64_to_user_ptr(batch.recs),
+			   array_size(batch.nr, sizeof(struct scull_rec)));
+	if (IS_ERR(recs))
+		return PTR_ERR(recs);
+	if (write) {
+		if (scull_down_read(dev)) {
+			kfree(recs);
+			return -ERESTARTSYS;
+		}
+		if (dev->sealed) {
+			up_read(&dev->lock);
+			kfree(recs);
+			return -EPERM;
+		}
+	} else {
+		idx = srcu_read_lock(&dev->srcu);
+		sd = srcu_dereference(dev->data, &dev->srcu);
+	}
+	size = READ_ONCE(dev->size);
+	for (i = 0; i < batch.nr; i++) {
+		rec = &recs[i];
+		if (fatal_signal_pending(current))
+			break;
+		if (rec->offset > LLONG_MAX || rec->len > LLONG_MAX-rec->offset) {
+			rec->res = -EINVAL;
+			continue;
+		}
+		rec->res = import_single_range(write ? WRITE : READ,
+					       u64_to_user_ptr(rec->buf),
+					       rec->len, &iov, &iter);
+		if (rec->res)
+			continue;
+		if (write)
+			rec->res = scull_write_locked(dev, rec->offset, &iter);
+		else
+			rec->res = scull_read(dev, sd, size, rec->offset, &iter);
+		if (rec->res > 0)
+			bytes += rec->res;
+		cond_resched();
+	}
+	if (write)
+		up_read(&dev->lock);
+	else
+		srcu_read_unlock(&dev->srcu, idx);
+	scull_account(dev, write ? SCULL_STAT_WRITE : SCULL_STAT_READ, bytes,
+		      start);
+	ret = i;
+	if (copy_to_user(u64_to_user_ptr(batch.recs), recs,
+			 sizeof(struct scull_rec)*i))
+		ret = -EFAULT;
+	kfree(recs);
+	return ret;
+}
+
+/* scull_seal() makes the device immutable, or mutable again.  The sealed
+ * readers neither compress nor touch the qsets, and the faults hand out
+ * the quantum pages without dev->lock.  It fails while the device is
+ * writably mapped on seal, and mapped at all on unseal. */
+static int scull_seal(struct scull_device *dev, bool seal)
+{
+	struct rw_semaphore *lock;
+	struct scull_qset *qset;
+	struct scull_data *sd;
+	unsigned long index;
+	int i, err = 0;
+
+	if (scull_down_write(dev))
+		return -ERESTARTSYS;
+	if (seal == dev->sealed)
+		goto out;
+	err = -EBUSY;
+	if (atomic_read(seal ? &dev->wmapped : &dev->mapped))
+		goto out;
+	err = 0;
+	if (!seal) {
+		WRITE_ONCE(dev->sealed, false);
+		/* drain the sealed readers before anything changes */
+		synchronize_srcu(&dev->srcu);
+		goto out;
+	}
+	/* the sealed readers find all the quanta in place, uncompressed */
+	sd = scull_locked_data(dev);
+	err = scull_restore_all(dev, sd);
+	if (err)
+		goto out;
+	xa_for_each(&sd->qsets, index, qset) {
+		lock = &dev->locks[index%SCULL_NR_LOCKS];
+		scull_qset_down_write(dev, lock);
+		for (i = 0; !err && i < qset->cap; i++)
+			if (scull_is_zquantum(qset->data[i]) &&
+			    !scull_decompress(dev, sd, &qset->data[i]))
+				err = -ENOMEM;
+		up_write(lock);
+		if (err)
+			goto out;
+		cond_resched();
+	}
+	smp_store_release(&dev->sealed, true);
+out:
+	up_write(&dev->lock);
+	return err;
+}
+
+/* scull_falloc() is SCULL_IOC_FALLOCATE, with the range checked as
+ * vfs_fallocate() would. */
+static long scull_falloc(struct file *fp, void __user *arg)
+{
+	struct scull_falloc fa;
+
+	if (!(fp->f_mode&FMODE_WRITE))
+		return -EBADF;
+	if (copy_from_user(&fa, arg, sizeof(fa)))
+		return -EFAULT;
+	if (fa.pad || !fa.len || fa.offset > LLONG_MAX ||
+	    fa.len > LLONG_MAX-fa.offset)
+		return -EINVAL;
+	/* punching never changes the size */
+	if (fa.mode&FALLOC_FL_PUNCH_HOLE && !(fa.mode&FALLOC_FL_KEEP_SIZE))
+		return -EINVAL;
+	return scull_fallocate(fp->private_data, fa.mode, fa.offset, fa.len);
+}
+
+static long ioctl(struct file *fp, unsigned int cmd, unsigned long arg)
+{
+	struct scull_clone clone;
+	struct fd src;
+	long ret;
+
+	switch (cmd) {
+	case SCULL_IOC_SNAPSHOT:
+		return scull_snapshot(fp);
+	case SCULL_IOC_READV:
+	case SCULL_IOC_WRITEV:
+		return scull_batch(fp, cmd, (void __user *)arg);
+	case SCULL_IOC_SEAL:
+	case SCULL_IOC_UNSEAL:
+		if (!(fp->f_mode&FMODE_WRITE))
+			return -EBADF;
+		return scull_seal(fp->private_data, cmd == SCULL_IOC_SEAL);
+	case SCULL_IOC_FALLOCATE:
+		return scull_falloc(fp, (void __user *)arg);
+	case SCULL_IOC_CLONE:
+	case SCULL_IOC_COPY:
+		break;
+	default:
+		return -ENOTTY;
+	}
+	if (copy_from_user(&clone, (void __user *)arg, sizeof(clone)))
+		return -EFAULT;
+	if (clone.src_offset > LLONG_MAX || clone.dest_offset > LLONG_MAX)
+		return -EINVAL;
+	src = fdget(clone.src_fd);
+	if (!src.file)
+		return -EBADF;
+	ret = -EXDEV;
+	if (src.file->f_op != fp->f_op)
+		goto out;
+	ret = -EBADF;
+	if (!(src.file->f_mode&FMODE_READ) || !(fp->f_mode&FMODE_WRITE))
+		goto out;
+	ret = scull_copy(fp, clone.dest_offset, src.file, clone.src_offset,
+			 clone.src_length, cmd == SCULL_IOC_CLONE);
+out:
+	fdput(src);
+	return ret;
+}
+
+static loff_t llseek(struct file *fp, loff_t offset, int whence)
+{
+	struct scull_device *dev = fp->private_data;
+	loff_t ret;
+	int idx;
+
+	if (scull_down_read(dev))
+		return -ERESTARTSYS;
+	switch (whence) {
+	case SEEK_SET:
+		break;
+	case SEEK_CUR:
+		offset += fp->f_pos;
+		break;
+	case SEEK_END:
+		offset += dev->size;
+		break;
+	case SEEK_DATA:
+	case SEEK_HOLE:
+		if (offset < 0 || offset >= dev->size) {
+			ret = -ENXIO;
+			goto out;
+		}
+		/* the qsets could grow under us */
+		idx = srcu_read_lock(&dev->srcu);
+		ret = scull_seek(scull_locked_data(dev), dev->size, offset,
+				 whence);
+		srcu_read_unlock(&dev->srcu, idx);
+		if (ret < 0)
+			goto out;
+		offset = ret;
+		break;
+	default:
+		ret = -EINVAL;
+		goto out;
+	}
+	if (offset < 0) {
+		ret = -EINVAL;
+		goto out;
+	}
+	fp->f_pos = offset;
+	ret = offset;
+out:
+	up_read(&dev->lock);
+	return ret;
+}
+
+long scull_fallocate(struct scull_device *dev, int mode, loff_t offset,
+		     loff_t len)
+{
+	struct rw_semaphore *lock, *locked = NULL;
+	loff_t pos, end = offset+len;
+	struct scull_data *sd;
+	long ret = 0;
+
+	if (mode&~(FALLOC_FL_KEEP_SIZE|FALLOC_FL_PUNCH_HOLE|FALLOC_FL_ZERO_RANGE))
+		return -EOPNOTSUPP;
+	if (scull_down_read(dev))
+		return -ERESTARTSYS;
+	sd = scull_locked_data(dev);
+	ret = dev->sealed ? -EPERM : scull_spill(dev, sd);
+	for (pos = offset; !ret && pos < end;
+	     pos += sd->quantum-pos%sd->quantum) {
+		lock = scull_qset_lock(dev, sd, pos);
+		if (lock != locked) {
+			if (locked)
+				up_write(locked);
+			scull_qset_down_write(dev, lock);
+			locked = lock;
+		}
+		/* zeros are holes, so the zeroed range is punched as well */
+		if (mode&(FALLOC_FL_PUNCH_HOLE|FALLOC_FL_ZERO_RANGE))
+			ret = scull_punch(dev, sd, pos, end);
+		else if (!scull_quantum(dev, sd, pos))
+			ret = -ENOMEM;
+		if (!ret && fatal_signal_pending(current))
+			ret = -EINTR;
+		if (ret)
+			break;
+	}
+	if (locked)
+		up_write(locked);
+	if (!ret && !(mode&FALLOC_FL_KEEP_SIZE))
+		scull_extend(dev, end);
+	up_read(&dev->lock);
+	return ret;
+}
+EXPORT_SYMBOL(scull_fallocate);
+
+/* scull_punch_file() punches [start, end) out of the backing file. */
+static int scull_punch_file(struct file *file, loff_t start, loff_t end)
+{
+	if (start >= end)
+		return 0;
+	return vfs_fallocate(file, FALLOC_FL_PUNCH_HOLE|FALLOC_FL_KEEP_SIZE,
+			     start, end-start);
+}
+
+/* scull_restore_snaps() restores into the snapshots what they still take
+ * from the backing file, but the device does not, before scull_persist()
+ * writes over it.  The caller holds dev->lock for writing. */
+static int scull_restore_snaps(struct scull_device *dev, struct scull_data *sd)
+{
+	struct scull_restore *r;
+	struct scull_snap *snap;
+	unsigned long i;
+	int err = 0;
+	loff_t pos;
+
+	mutex_lock(&dev->snaps_lock);
+	list_for_each_entry(snap, &dev->snaps, node) {
+		mutex_lock(&snap->lock);
+		r = snap->sd->restore;
+		for_each_clear_bit(i, r->done, r->nr) {
+			pos = (loff_t)i*snap->sd->quantum;
+			if (sd->quantum == snap->sd->quantum &&
+			    scull_pending(sd, pos))
+				continue;
+			err = __scull_restore(dev, snap->sd, pos);
+			if (err)
+				break;
+			cond_resched();
+		}
+		mutex_unlock(&snap->lock);
+		if (err)
+			break;
+	}
+	mutex_unlock(&dev->snaps_lock);
+	return err;
+}
+
+/* scull_persist() writes the data sparsely into the backing file, with
+ * the holes punched out, and leaves what has not been restored from the
+ * file as it is. */
+static int scull_persist(struct scull_device *dev)
+{
+	struct file *file = dev->backing;
+	loff_t pos, off, hole = 0, size;
+	struct rw_semaphore *lock;
+	struct scull_data *sd;
+	void *data, *buf = NULL;
+	ssize_t len, ret;
+	int err = 0;
+
+	if (!file)
+		return -EINVAL;
+	if (scull_down_write(dev))
+		return -ERESTARTSYS;
+	sd = scull_locked_data(dev);
+	size = dev->size;
+	err = scull_restore_snaps(dev, sd);
+	for (pos = 0; !err && pos < size; pos += sd->quantum) {
+		if (scull_pending(sd, pos)) {
+			err = scull_punch_file(file, hole, pos);
+			hole = pos+sd->quantum;
+			continue;
+		}
+		/* against the readers decompressing it in place */
+		lock = scull_qset_lock(dev, sd, pos);
+		scull_qset_down_read(dev, lock);
+		data = scull_lookup(sd, pos, false);
+		len = min_t(loff_t, sd->quantum, size-pos);
+		if (data == sd->idata)
+			len = min_t(loff_t, len, SCULL_INLINE_MAX);
+		if (scull_is_zquantum(data)) {
+			if (!buf)
+				buf = kvmalloc(sd->quantum, GFP_KERNEL);
+			if (!buf)
+				err = -ENOMEM;
+			else
+				err = scull_unzip(sd, scull_zquantum(data), buf);
+			data = buf;
+		}
+		if (!err && data) {
+			off = pos;
+			ret = kernel_write(file, data, len, &off);
+			if (ret != len)
+				err = ret < 0 ? ret : -EIO;
+		}
+		up_read(lock);
+		if (!err && data) {
+			err = scull_punch_file(file, hole, pos);
+			hole = pos+len;
+		}
+		cond_resched();
+	}
+	if (!err)
+		err = scull_punch_file(file, hole, size);
+	if (!err)
+		err = vfs_truncate(&file->f_path, size);
+	up_write(&dev->lock);
+	kvfree(buf);
+	if (!err)
+		err = vfs_fsync(file, 0);
+	return err;
+}
 
-static struct scull_qset *scull_follow(struct scull_device *dev, loff_t pos)
+/* fsync(2) persists the device into the backing file. */
+static int fsync(struct file *fp, loff_t start, loff_t end, int datasync)
 {
-	size_t ssize = sizeof(struct scull_qset)+sizeof(void *)*dev->qset;
-	struct scull_qset *newp, **datap = &dev->data;
-	int i, spos = pos/(dev->quantum*dev->qset);
+	return scull_persist(fp->private_data);
+}
 
-	for (i = 0; i < spos; i++) {
-		if (*datap) {
-			datap = &(*datap)->next;
-			continue;
-		}
-		newp = kmalloc(ssize, GFP_KERNEL);
-		if (!newp)
-			return NULL;
-		memset(newp, 0, ssize);
-		*datap = newp;
-		datap = &newp->next;
-	}
-	if (*datap)
-		return *datap;
-	newp = kmalloc(ssize, GFP_KERNEL);
-	if (!newp)
-		return NULL;
-	memset(newp, 0, ssize);
-	*datap = newp;
-	return newp;
+/* scull_inline_page() returns a copy of the inline data, for the
+ * mappings not to spill it. */
+static struct page *scull_inline_page(struct scull_data *sd)
+{
+	struct page *page = alloc_page(GFP_HIGHUSER|__GFP_ZERO);
+
+	if (!page)
+		return ERR_PTR(-ENOMEM);
+	memcpy_to_page(page, 0, sd->idata, SCULL_INLINE_MAX);
+	return page;
 }
 
-static void scull_trim(struct scull_device *dev)
+/* scull_sealed_page() returns the page at pos of the sealed device with
+ * a reference, without any lock, NULL for the hole, or ERR_PTR(-EAGAIN)
+ * for the locked path to go.  It never allocates the quanta. */
+static struct page *scull_sealed_page(struct scull_device *dev, loff_t pos)
 {
-	struct scull_qset *data, *next;
-	int i;
+	struct scull_data *sd;
+	struct page *page;
+	void *data;
+	int idx;
 
-	for (data = dev->data; data; data = next) {
-		for (i = 0; i < dev->qset; i++)
-			if (data->data[i])
-				kfree(data->data[i]);
-		next = data->next;
-		kfree(data);
+	if (!smp_load_acquire(&dev->sealed))
+		return ERR_PTR(-EAGAIN);
+	idx = srcu_read_lock(&dev->srcu);
+	sd = srcu_dereference(dev->data, &dev->srcu);
+	if (sd->quantum%PAGE_SIZE || pos >= READ_ONCE(dev->size)) {
+		page = ERR_PTR(-ENXIO);
+		goto out;
 	}
-	dev->data = NULL;
-	dev->size = 0;
+	data = scull_lookup(sd, pos, false);
+	if (!data) {
+		page = NULL;
+	} else if (scull_is_inline(sd, data)) {
+		page = scull_inline_page(sd);
+	} else {
+		page = scull_quantum_page(data+pos%sd->quantum);
+		get_page(page);
+	}
+out:
+	srcu_read_unlock(&dev->srcu, idx);
+	return page;
 }
 
-static ssize_t read(struct file *fp, char __user *buf, size_t count, loff_t *pos)
+/* scull_fault_page() returns the page at pos for the mappings not to
+ * write into the device, without allocating the quanta, or NULL for
+ * the hole to be the zero page.  The caller holds dev->lock for reading. */
+static struct page *scull_fault_page(struct scull_device *dev,
+				     struct scull_data *sd, loff_t pos)
 {
-	struct scull_device *dev = fp->private_data;
+	struct rw_semaphore *lock = scull_qset_lock(dev, sd, pos);
+	struct page *page = ERR_PTR(-ENOMEM);
 	struct scull_qset *qset;
-	ssize_t ret = -ENOMEM;
-	size_t spos, qpos, dpos;
-	size_t rem, len;
-	void **data;
+	void *data;
 
-	if (mutex_lock_interruptible(&dev->lock))
-		return -ERESTARTSYS;
-	if (*pos > dev->size) {
-		ret = 0;
+	scull_qset_down_write(dev, lock);
+	/* the sealed device is all restored and decompressed */
+	if (!dev->sealed && __scull_restore(dev, sd, pos))
 		goto out;
+	data = scull_lookup(sd, pos, !dev->sealed);
+	if (scull_is_zquantum(data)) {
+		if (WARN_ON_ONCE(dev->sealed))
+			goto out;
+		qset = xa_load(&sd->qsets, pos/(sd->quantum*sd->qset));
+		data = scull_decompress(dev, sd, scull_slot(sd, qset, pos));
+		if (!data)
+			goto out;
+		data = scull_raw(data);
 	}
-	qset = scull_follow(dev, *pos);
-	if (!qset)
+	if (!data) {
+		page = NULL;
+	} else if (scull_is_inline(sd, data)) {
+		page = scull_inline_page(sd);
+	} else {
+		page = scull_quantum_page(data+pos%sd->quantum);
+		get_page(page);
+	}
+out:
+	up_write(lock);
+	return page;
+}
+
+/* scull_zero_fault() maps the hole to the zero page, read only. */
+static vm_fault_t scull_zero_fault(struct vm_fault *vmf)
+{
+	unsigned long pfn = my_zero_pfn(vmf->address);
+
+	return vmf_insert_mixed(vmf->vma, vmf->address, pfn_to_pfn_t(pfn));
+}
+
+/* fault() allocates the quanta and extends the device only on the write
+ * fault of the shared writable mapping, which writes through the quantum
+ * pages in place.  Its read fault maps the hole to the zero page, for
+ * mkwrite() to allocate on the first write.  The others copy on write. */
+static vm_fault_t fault(struct vm_fault *vmf)
+{
+	struct vm_area_struct *vma = vmf->vma;
+	struct scull_device *dev = vma->vm_file->private_data;
+	loff_t pos = (loff_t)vmf->pgoff << PAGE_SHIFT;
+	vm_fault_t ret = VM_FAULT_SIGBUS;
+	u64 start = ktime_get_ns();
+	struct rw_semaphore *lock;
+	struct scull_data *sd;
+	struct page *page;
+	void *data;
+
+	page = scull_sealed_page(dev, pos);
+	if (!page)
+		return scull_zero_fault(vmf);
+	if (!IS_ERR(page)) {
+		vmf->page = page;
+		return 0;
+	}
+	if (PTR_ERR(page) == -ENOMEM)
+		return VM_FAULT_OOM;
+	if (PTR_ERR(page) != -EAGAIN)
+		return VM_FAULT_SIGBUS;
+	down_read(&dev->lock);
+	scull_account(dev, SCULL_STAT_LOCK, 0, start);
+	sd = scull_locked_data(dev);
+	/* quantum could have been changed after mmap(2) */
+	if (sd->quantum%PAGE_SIZE)
 		goto out;
-	spos = *pos%(dev->qset*dev->quantum);
-	qpos = spos/dev->quantum;
-	dpos = spos%dev->quantum;
-	data = &qset->data[qpos];
-	if (!*data) {
-		*data = kmalloc(dev->quantum, GFP_KERNEL);
-		if (!*data)
+	/* the shared mappings see what write(2) writes, not a copy of the
+	 * inline data, even after the trim inlines it again */
+	if (!dev->sealed && (vma->vm_flags&VM_SHARED) && scull_spill(dev, sd)) {
+		ret = VM_FAULT_OOM;
+		goto out;
+	}
+	/* nor the sealed one, mapped after the lockless try */
+	if (dev->sealed || !(vmf->flags&FAULT_FLAG_WRITE) ||
+	    (vma->vm_flags&(VM_SHARED|VM_MAYWRITE)) != (VM_SHARED|VM_MAYWRITE)) {
+		if (pos >= READ_ONCE(dev->size))
 			goto out;
-		memset(*data, 0, dev->quantum);
-	}
-	if (dpos+count > dev->quantum)
-		count = dev->quantum-dpos;
-	len = count;
-	while ((rem = copy_to_user(buf, *data+dpos, len))) {
-		dpos += len-rem;
-		buf += len-rem;
-		len = rem;
-	}
-	*pos += count;
-	ret = count;
+		page = scull_fault_page(dev, sd, pos);
+		if (IS_ERR(page))
+			ret = VM_FAULT_OOM;
+		else if (!page)
+			ret = scull_zero_fault(vmf);
+		else {
+			vmf->page = page;
+			ret = 0;
+		}
+		goto out;
+	}
+	/* the write extends the device */
+	lock = scull_qset_lock(dev, sd, pos);
+	scull_qset_down_write(dev, lock);
+	data = scull_quantum(dev, sd, pos);
+	if (data) {
+		vmf->page = scull_quantum_page(data+pos%sd->quantum);
+		get_page(vmf->page);
+	}
+	up_write(lock);
+	if (!data) {
+		ret = VM_FAULT_OOM;
+		goto out;
+	}
+	scull_extend(dev, pos+PAGE_SIZE);
+	ret = 0;
+out:
+	up_read(&dev->lock);
+	return ret;
+}
+
+/* mkwrite() is both page_mkwrite and pfn_mkwrite, the latter for the
+ * zero page, of the shared writable mapping.  It allocates the hole, or
+ * unshares the quantum, and zaps the pte for the write to fault the new
+ * page in.  Otherwise it returns the page locked, to be written. */
+static vm_fault_t mkwrite(struct vm_fault *vmf)
+{
+	struct vm_area_struct *vma = vmf->vma;
+	struct scull_device *dev = vma->vm_file->private_data;
+	loff_t pos = (loff_t)vmf->pgoff << PAGE_SHIFT;
+	vm_fault_t ret = VM_FAULT_SIGBUS;
+	u64 start = ktime_get_ns();
+	struct page *page = NULL;
+	struct rw_semaphore *lock;
+	struct scull_data *sd;
+	void *data;
+
+	down_read(&dev->lock);
+	scull_account(dev, SCULL_STAT_LOCK, 0, start);
+	sd = scull_locked_data(dev);
+	if (sd->quantum%PAGE_SIZE || dev->sealed)
+		goto out;
+	if (scull_spill(dev, sd)) {
+		ret = VM_FAULT_OOM;
+		goto out;
+	}
+	lock = scull_qset_lock(dev, sd, pos);
+	scull_qset_down_write(dev, lock);
+	data = scull_quantum(dev, sd, pos);
+	if (data)
+		page = scull_quantum_page(data+pos%sd->quantum);
+	up_write(lock);
+	if (!data) {
+		ret = VM_FAULT_OOM;
+		goto out;
+	}
+	scull_extend(dev, pos+PAGE_SIZE);
+	if (page == vmf->page) {
+		lock_page(page);
+		ret = VM_FAULT_LOCKED;
+	} else
+		ret = VM_FAULT_NOPAGE;
 out:
-	mutex_unlock(&dev->lock);
+	up_read(&dev->lock);
+	if (ret == VM_FAULT_NOPAGE)
+		unmap_mapping_range(vma->vm_file->f_mapping, pos, PAGE_SIZE, 0);
 	return ret;
 }
 
-static ssize_t write(struct file *fp, const char __user *buf, size_t count, loff_t *pos)
+/* the mappings are counted for scull_seal() */
+static void vm_open(struct vm_area_struct *vma)
+{
+	struct scull_device *dev = vma->vm_file->private_data;
+
+	atomic_inc(&dev->mapped);
+	if ((vma->vm_flags&(VM_SHARED|VM_MAYWRITE)) == (VM_SHARED|VM_MAYWRITE))
+		atomic_inc(&dev->wmapped);
+}
+
+static void vm_close(struct vm_area_struct *vma)
+{
+	struct scull_device *dev = vma->vm_file->private_data;
+
+	if ((vma->vm_flags&(VM_SHARED|VM_MAYWRITE)) == (VM_SHARED|VM_MAYWRITE))
+		atomic_dec(&dev->wmapped);
+	atomic_dec(&dev->mapped);
+}
+
+static int mmap(struct file *fp, struct vm_area_struct *vma)
 {
 	struct scull_device *dev = fp->private_data;
-	struct scull_qset *qset;
-	ssize_t ret = -ENOMEM;
-	size_t spos, qpos, dpos;
-	size_t rem, len;
-	void **data;
+	int err = 0;
 
-	if (mutex_lock_interruptible(&dev->lock))
+	if (down_read_killable(&dev->lock))
 		return -ERESTARTSYS;
-	qset = scull_follow(dev, *pos);
-	if (!qset)
+	/* only the page backed quanta can be mapped */
+	if (scull_locked_data(dev)->quantum%PAGE_SIZE) {
+		err = -EINVAL;
 		goto out;
-	spos = *pos%(dev->qset*dev->quantum);
-	qpos = spos/dev->quantum;
-	dpos = spos%dev->quantum;
-	data = &qset->data[qpos];
-	if (!*data) {
-		*data = kmalloc(dev->quantum, GFP_KERNEL);
-		if (!*data)
+	}
+	/* and the sealed ones only for reading */
+	if (dev->sealed && (vma->vm_flags&VM_SHARED)) {
+		if (vma->vm_flags&VM_WRITE) {
+			err = -EPERM;
 			goto out;
-		memset(*data, 0, dev->quantum);
-	}
-	/* per quantum write */
-	if (count > dev->quantum-dpos)
-		count = dev->quantum-dpos;
-	/* copy_from_user() does not return error */
-	len = count;
-	while ((rem = copy_from_user(*data+dpos, buf, len))) {
-		dpos += len-rem;
-		buf += len-rem;
-		len = rem;
-	}
-	if (dev->size < *pos+count)
-		dev->size = *pos+count;
-	*pos += count;
-	ret = count;
+		}
+		vma->vm_flags &= ~VM_MAYWRITE;
+	}
+	/* the shared ones map the quanta write(2) goes to */
+	if (!dev->sealed && (vma->vm_flags&VM_SHARED) &&
+	    scull_spill(dev, scull_locked_data(dev))) {
+		err = -ENOMEM;
+		goto out;
+	}
+	vma->vm_ops = &scull_driver.vm_ops;
+	/* for the zero page on the holes */
+	vma->vm_flags |= VM_DONTEXPAND|VM_MIXEDMAP;
+	/* counted before scull_seal() could look */
+	vm_open(vma);
 out:
-	mutex_unlock(&dev->lock);
-	return ret;
+	up_read(&dev->lock);
+	return err;
+}
+
+static int init_device(struct scull_driver *drv, struct scull_device *dev);
+static void term_device(struct scull_device *dev);
+
+/* scull_attach() opens the backing file of the minor, and brings the
+ * device up at the file size, with the quanta restored from it on the
+ * first access. */
+static int scull_attach(struct scull_driver *drv, struct scull_device *dev,
+			int minor)
+{
+	struct scull_data *sd = rcu_dereference_protected(dev->data, 1);
+	struct scull_restore *r;
+	struct file *file;
+	unsigned long nr;
+	char *path;
+	loff_t size;
+
+	if (!drv->backing)
+		return 0;
+	path = kasprintf(GFP_KERNEL, "%s%d", drv->backing, minor);
+	if (!path)
+		return -ENOMEM;
+	file = filp_open(path, O_RDWR|O_CREAT|O_LARGEFILE, 0600);
+	kfree(path);
+	if (IS_ERR(file))
+		return PTR_ERR(file);
+	if (!S_ISREG(file_inode(file)->i_mode)) {
+		filp_close(file, NULL);
+		return -EINVAL;
+	}
+	size = i_size_read(file_inode(file));
+	nr = DIV_ROUND_UP(size, sd->quantum);
+	if (nr) {
+		r = kvzalloc(struct_size(r, done, BITS_TO_LONGS(nr)),
+			     GFP_KERNEL);
+		if (!r) {
+			filp_close(file, NULL);
+			return -ENOMEM;
+		}
+		r->nr = nr;
+		atomic_long_set(&r->left, nr);
+		sd->restore = r;
+		/* nothing inline, it is all in the file */
+		sd->inlined = false;
+	}
+	dev->backing = file;
+	dev->size = size;
+	return 0;
+}
+
+/* scull_get() returns the device of the node, and instantiates it on
+ * the first call, attached to its backing file if any. */
+static struct scull_device *scull_get(struct scull_driver *drv,
+				      struct scull_node *node)
+{
+	struct scull_device *dev = smp_load_acquire(&node->dev);
+	int err;
+
+	if (dev)
+		return dev;
+	if (mutex_lock_interruptible(&drv->lock))
+		return ERR_PTR(-ERESTARTSYS);
+	dev = node->dev;
+	if (dev)
+		goto out;
+	dev = kzalloc(sizeof(struct scull_device), GFP_KERNEL);
+	if (!dev) {
+		dev = ERR_PTR(-ENOMEM);
+		goto out;
+	}
+	err = init_device(drv, dev);
+	if (err) {
+		kfree(dev);
+		dev = ERR_PTR(err);
+		goto out;
+	}
+	err = scull_attach(drv, dev, node-drv->nodes);
+	if (err) {
+		term_device(dev);
+		kfree(dev);
+		dev = ERR_PTR(err);
+		goto out;
+	}
+	smp_store_release(&node->dev, dev);
+out:
+	mutex_unlock(&drv->lock);
+	return dev;
+}
+
+/* scull_attr_device() returns the device for the attribute.  The stores
+ * instantiate it, but the shows of the idle nodes get the defaults from
+ * the idle device. */
+static struct scull_device *scull_attr_device(struct device *base, bool store)
+{
+	struct scull_node *node = container_of(base, struct scull_node, base);
+	struct scull_device *dev;
+
+	if (store)
+		return scull_get(&scull_driver, node);
+	dev = smp_load_acquire(&node->dev);
+	return dev ? dev : &scull_driver.idle;
 }
 
 static int open(struct inode *ip, struct file *fp)
 {
-	struct scull_device *dev = container_of(ip->i_cdev, struct scull_device, cdev);
+	struct scull_driver *drv = &scull_driver;
+	struct scull_device *dev;
+	struct scull_data *sd;
+	int err;
+
+	dev = scull_get(drv, &drv->nodes[iminor(ip)-MINOR(drv->devt)]);
+	if (IS_ERR(dev))
+		return PTR_ERR(dev);
 	fp->private_data = dev;
 	if ((fp->f_flags&O_ACCMODE) == O_RDONLY)
 		return 0;
 	if (!(fp->f_flags&O_TRUNC))
 		return 0;
-	if (mutex_lock_interruptible(&dev->lock))
+	if (scull_down_write(dev))
 		return -ERESTARTSYS;
-	scull_trim(dev);
-	mutex_unlock(&dev->lock);
-	return 0;
+	sd = scull_locked_data(dev);
+	if (dev->sealed)
+		err = -EPERM;
+	else
+		err = scull_trim(dev, sd->qset, sd->quantum);
+	up_write(&dev->lock);
+	return err;
 }
 
 static ssize_t qset_show(struct device *base, struct device_attribute *attr,
 			 char *page)
 {
-	struct scull_device *dev = container_of(base, struct scull_device, base);
+	struct scull_device *dev = scull_attr_device(base, false);
 	size_t qset;
-	if (mutex_lock_interruptible(&dev->lock))
+	if (down_read_killable(&dev->lock))
 		return -ERESTARTSYS;
-	qset = dev->qset;
-	mutex_unlock(&dev->lock);
+	qset = scull_locked_data(dev)->qset;
+	up_read(&dev->lock);
 	return snprintf(page, PAGE_SIZE, "%ld\n", qset);
 }
 
 static ssize_t qset_store(struct device *base, struct device_attribute *attr,
 			  const char *page, size_t count)
 {
-	struct scull_device *dev = container_of(base, struct scull_device, base);
+	struct scull_device *dev;
+	struct scull_data *sd;
 	long qset;
 	int err;
 
 	err = kstrtol(page, 10, &qset);
 	if (err)
 		return err;
-	if (mutex_lock_interruptible(&dev->lock))
+	if (qset <= 0)
+		return -EINVAL;
+	dev = scull_attr_device(base, true);
+	if (IS_ERR(dev))
+		return PTR_ERR(dev);
+	if (down_write_killable(&dev->lock))
 		return -ERESTARTSYS;
-	if (qset == dev->qset)
-		goto out;
-	scull_trim(dev);
-	dev->qset = qset;
-out:
-	mutex_unlock(&dev->lock);
-	return count;
+	sd = scull_locked_data(dev);
+	if (dev->sealed)
+		err = -EPERM;
+	else if (qset != sd->qset)
+		err = scull_trim(dev, qset, sd->quantum);
+	up_write(&dev->lock);
+	return err ? err : count;
 }
 static DEVICE_ATTR_RW(qset);
 
 static ssize_t quantum_show(struct device *base, struct device_attribute *attr,
 			    char *page)
 {
-	struct scull_device *dev = container_of(base, struct scull_device, base);
+	struct scull_device *dev = scull_attr_device(base, false);
 	size_t quantum;
-	if (mutex_lock_interruptible(&dev->lock))
-	    return -ERESTARTSYS;
-	quantum = dev->quantum;
-	mutex_unlock(&dev->lock);
+	if (down_read_killable(&dev->lock))
+		return -ERESTARTSYS;
+	quantum = scull_locked_data(dev)->quantum;
+	up_read(&dev->lock);
 	return snprintf(page, PAGE_SIZE, "%ld\n", quantum);
 }
 
 static ssize_t quantum_store(struct device *base, struct device_attribute *attr,
 			     const char *page, size_t count)
 {
-	struct scull_device *dev = container_of(base, struct scull_device, base);
+	struct scull_device *dev;
+	struct scull_data *sd;
 	long quantum;
 	int err;
 
 	err = kstrtol(page, 10, &quantum);
 	if (err)
 		return err;
-	if (mutex_lock_interruptible(&dev->lock))
+	if (quantum <= 0 || quantum > SCULL_QUANTUM_MAX)
+		return -EINVAL;
+	/* page backed quanta are made of whole pages */
+	if (quantum > PAGE_SIZE && quantum%PAGE_SIZE)
+		return -EINVAL;
+	dev = scull_attr_device(base, true);
+	if (IS_ERR(dev))
+		return PTR_ERR(dev);
+	if (down_write_killable(&dev->lock))
 		return -ERESTARTSYS;
-	if (quantum == dev->quantum)
-		goto out;
-	scull_trim(dev);
-	dev->quantum = quantum;
-out:
-	mutex_unlock(&dev->lock);
-	return count;
+	sd = scull_locked_data(dev);
+	if (dev->sealed)
+		err = -EPERM;
+	else if (quantum != sd->quantum)
+		err = scull_trim(dev, sd->qset, quantum);
+	up_write(&dev->lock);
+	return err ? err : count;
 }
 static DEVICE_ATTR_RW(quantum);
 
 static ssize_t size_show(struct device *base, struct device_attribute *attr,
 			 char *page)
 {
-	struct scull_device *dev = container_of(base, struct scull_device, base);
-	size_t size;
-	if (mutex_lock_interruptible(&dev->lock))
-		return -ERESTARTSYS;
-	size = dev->size;
-	mutex_unlock(&dev->lock);
+	struct scull_device *dev = scull_attr_device(base, false);
+	size_t size = READ_ONCE(dev->size);
 	return snprintf(page, PAGE_SIZE, "%ld\n", size);
 }
 static DEVICE_ATTR_RO(size);
 
+/* quanta in memory, raw or compressed */
+static ssize_t allocated_bytes_show(struct device *base,
+				    struct device_attribute *attr, char *page)
+{
+	struct scull_device *dev = scull_attr_device(base, false);
+	struct scull_data *sd;
+	long bytes;
+	if (down_read_killable(&dev->lock))
+		return -ERESTARTSYS;
+	sd = scull_locked_data(dev);
+	bytes = atomic_long_read(&sd->nr_quanta)*sd->quantum;
+	bytes += atomic_long_read(&sd->zbytes);
+	up_read(&dev->lock);
+	return snprintf(page, PAGE_SIZE, "%ld\n", bytes);
+}
+static DEVICE_ATTR_RO(allocated_bytes);
+
+static ssize_t compress_ms_show(struct device *base,
+				struct device_attribute *attr, char *page)
+{
+	struct scull_device *dev = scull_attr_device(base, false);
+	return snprintf(page, PAGE_SIZE, "%u\n", READ_ONCE(dev->compress_ms));
+}
+
+static ssize_t compress_ms_store(struct device *base,
+				 struct device_attribute *attr,
+				 const char *page, size_t count)
+{
+	struct scull_device *dev;
+	struct scull_driver *drv = &scull_driver;
+	unsigned int ms;
+	int err;
+
+	err = kstrtouint(page, 10, &ms);
+	if (err)
+		return err;
+	if (ms && !drv->tfm)
+		return -ENODEV;
+	dev = scull_attr_device(base, true);
+	if (IS_ERR(dev))
+		return PTR_ERR(dev);
+	if (ms) {
+		mutex_lock(&drv->zlock);
+		if (!drv->zbuf)
+			drv->zbuf = vmalloc(SCULL_QUANTUM_MAX);
+		mutex_unlock(&drv->zlock);
+		if (!drv->zbuf)
+			return -ENOMEM;
+	}
+	WRITE_ONCE(dev->compress_ms, ms);
+	if (ms)
+		mod_delayed_work(system_unbound_wq, &dev->compress,
+				 msecs_to_jiffies(ms));
+	else
+		cancel_delayed_work_sync(&dev->compress);
+	return count;
+}
+static DEVICE_ATTR_RW(compress_ms);
+
+static ssize_t compressed_bytes_show(struct device *base,
+				     struct device_attribute *attr, char *page)
+{
+	struct scull_device *dev = scull_attr_device(base, false);
+	long zbytes;
+	if (down_read_killable(&dev->lock))
+		return -ERESTARTSYS;
+	zbytes = atomic_long_read(&scull_locked_data(dev)->zbytes);
+	up_read(&dev->lock);
+	return snprintf(page, PAGE_SIZE, "%ld\n", zbytes);
+}
+static DEVICE_ATTR_RO(compressed_bytes);
+
+static ssize_t compress_ratio_show(struct device *base,
+				   struct device_attribute *attr, char *page)
+{
+	struct scull_device *dev = scull_attr_device(base, false);
+	unsigned long zbytes, zorig;
+	struct scull_data *sd;
+	if (down_read_killable(&dev->lock))
+		return -ERESTARTSYS;
+	sd = scull_locked_data(dev);
+	zbytes = atomic_long_read(&sd->zbytes);
+	zorig = atomic_long_read(&sd->zorig);
+	up_read(&dev->lock);
+	if (!zbytes)
+		return snprintf(page, PAGE_SIZE, "0.00\n");
+	return snprintf(page, PAGE_SIZE, "%lu.%02lu\n", zorig/zbytes,
+			zorig*100/zbytes%100);
+}
+static DEVICE_ATTR_RO(compress_ratio);
+
+/* average decompression latency */
+static ssize_t decompress_ns_show(struct device *base,
+				  struct device_attribute *attr, char *page)
+{
+	struct scull_device *dev = scull_attr_device(base, false);
+	u64 nr = atomic64_read(&dev->decompress_nr);
+	u64 ns = atomic64_read(&dev->decompress_ns);
+	return snprintf(page, PAGE_SIZE, "%llu\n", nr ? div64_u64(ns, nr) : 0);
+}
+static DEVICE_ATTR_RO(decompress_ns);
+
+static ssize_t numa_policy_show(struct device *base,
+				struct device_attribute *attr, char *page)
+{
+	struct scull_device *dev = scull_attr_device(base, false);
+	int nid = READ_ONCE(dev->numa_policy);
+	if (nid == SCULL_NUMA_LOCAL)
+		return snprintf(page, PAGE_SIZE, "local\n");
+	if (nid == SCULL_NUMA_INTERLEAVE)
+		return snprintf(page, PAGE_SIZE, "interleave\n");
+	return snprintf(page, PAGE_SIZE, "%d\n", nid);
+}
+
+/* local to the writer, interleaved over the online nodes, or the node */
+static ssize_t numa_policy_store(struct device *base,
+				 struct device_attribute *attr,
+				 const char *page, size_t count)
+{
+	struct scull_device *dev;
+	int nid;
+
+	if (sysfs_streq(page, "local"))
+		nid = SCULL_NUMA_LOCAL;
+	else if (sysfs_streq(page, "interleave"))
+		nid = SCULL_NUMA_INTERLEAVE;
+	else if (kstrtoint(page, 10, &nid))
+		return -EINVAL;
+	else if (nid < 0 || nid >= nr_node_ids || !node_online(nid))
+		return -EINVAL;
+	dev = scull_attr_device(base, true);
+	if (IS_ERR(dev))
+		return PTR_ERR(dev);
+	WRITE_ONCE(dev->numa_policy, nid);
+	/* the pools were filled under the old policy */
+	scull_drain_pools(dev);
+	return count;
+}
+static DEVICE_ATTR_RW(numa_policy);
+
+/* scull_numa_show() prints the per node counters of each online node, in
+ * the numa_maps(5) format. */
+static ssize_t scull_numa_show(const atomic_long_t *counters, char *page)
+{
+	ssize_t len = 0;
+	int nid;
+
+	for_each_online_node(nid)
+		len += scnprintf(page+len, PAGE_SIZE-len, "%sN%d=%ld",
+				 len ? " " : "", nid,
+				 atomic_long_read(&counters[nid]));
+	len += scnprintf(page+len, PAGE_SIZE-len, "\n");
+	return len;
+}
+
+/* quanta allocated on each node, ever */
+static ssize_t numa_allocs_show(struct device *base,
+				struct device_attribute *attr, char *page)
+{
+	struct scull_device *dev = scull_attr_device(base, false);
+	return scull_numa_show(dev->numa_allocs, page);
+}
+static DEVICE_ATTR_RO(numa_allocs);
+
+/* quanta in the slots on each node, the trimmed and snapshot ones too */
+static ssize_t numa_resident_show(struct device *base,
+				  struct device_attribute *attr, char *page)
+{
+	struct scull_device *dev = scull_attr_device(base, false);
+	return scull_numa_show(dev->numa_resident, page);
+}
+static DEVICE_ATTR_RO(numa_resident);
+
+/* pre-zeroed for the writers, not in the allocated bytes */
+static ssize_t pooled_bytes_show(struct device *base,
+				 struct device_attribute *attr, char *page)
+{
+	struct scull_device *dev = scull_attr_device(base, false);
+	size_t bytes;
+	scull_pooled(dev, &bytes);
+	return snprintf(page, PAGE_SIZE, "%ld\n", bytes);
+}
+static DEVICE_ATTR_RO(pooled_bytes);
+
+/* trimmed, but not freed yet */
+static ssize_t pending_free_bytes_show(struct device *base,
+				       struct device_attribute *attr, char *page)
+{
+	struct scull_device *dev = scull_attr_device(base, false);
+	return snprintf(page, PAGE_SIZE, "%ld\n",
+			atomic_long_read(&dev->pending_free));
+}
+static DEVICE_ATTR_RO(pending_free_bytes);
+
+static ssize_t sealed_show(struct device *base, struct device_attribute *attr,
+			   char *page)
+{
+	struct scull_device *dev = scull_attr_device(base, false);
+	return snprintf(page, PAGE_SIZE, "%d\n", READ_ONCE(dev->sealed));
+}
+
+static ssize_t sealed_store(struct device *base, struct device_attribute *attr,
+			    const char *page, size_t count)
+{
+	struct scull_device *dev;
+	bool seal;
+	int err;
+
+	err = kstrtobool(page, &seal);
+	if (err)
+		return err;
+	dev = scull_attr_device(base, true);
+	if (IS_ERR(dev))
+		return PTR_ERR(dev);
+	err = scull_seal(dev, seal);
+	return err ? err : count;
+}
+static DEVICE_ATTR_RW(sealed);
+
+/* operations, bytes and nanoseconds spent */
+static ssize_t stat_show(struct device *base, struct device_attribute *attr,
+			 char *page)
+{
+	struct dev_ext_attribute *ea = container_of(attr, struct dev_ext_attribute, attr);
+	struct scull_device *dev = scull_attr_device(base, false);
+	enum scull_stat stat = (uintptr_t)ea->var;
+	u64 nr = 0, bytes = 0, ns = 0;
+	struct scull_stats *st;
+	int cpu;
+	for_each_possible_cpu(cpu) {
+		st = per_cpu_ptr(dev->stats, cpu);
+		nr += READ_ONCE(st->nr[stat]);
+		bytes += READ_ONCE(st->bytes[stat]);
+		ns += READ_ONCE(st->ns[stat]);
+	}
+	return snprintf(page, PAGE_SIZE, "%llu %llu %llu\n", nr, bytes, ns);
+}
+
+/* the bucket i counts the operations taking [2^i, 2^(i+1)) ns */
+static ssize_t hist_show(struct device *base, struct device_attribute *attr,
+			 char *page)
+{
+	struct dev_ext_attribute *ea = container_of(attr, struct dev_ext_attribute, attr);
+	struct scull_device *dev = scull_attr_device(base, false);
+	enum scull_stat stat = (uintptr_t)ea->var;
+	u64 hist[SCULL_NR_BUCKETS] = {0};
+	struct scull_stats *st;
+	ssize_t len = 0;
+	int cpu, i;
+	for_each_possible_cpu(cpu) {
+		st = per_cpu_ptr(dev->stats, cpu);
+		for (i = 0; i < SCULL_NR_BUCKETS; i++)
+			hist[i] += READ_ONCE(st->hist[stat][i]);
+	}
+	for (i = 0; i < SCULL_NR_BUCKETS; i++)
+		len += scnprintf(page+len, PAGE_SIZE-len, "%s%llu",
+				 i ? " " : "", hist[i]);
+	len += scnprintf(page+len, PAGE_SIZE-len, "\n");
+	return len;
+}
+
+#define SCULL_STAT_ATTR(_name, _stat)					\
+	static struct dev_ext_attribute dev_attr_##_name = {		\
+		__ATTR(_name, 0444, stat_show, NULL), (void *)(_stat)	\
+	};								\
+	static struct dev_ext_attribute dev_attr_##_name##_hist = {	\
+		__ATTR(_name##_hist, 0444, hist_show, NULL), (void *)(_stat) \
+	}
+
+SCULL_STAT_ATTR(read, SCULL_STAT_READ);
+SCULL_STAT_ATTR(write, SCULL_STAT_WRITE);
+SCULL_STAT_ATTR(trim, SCULL_STAT_TRIM);
+SCULL_STAT_ATTR(alloc, SCULL_STAT_ALLOC);
+SCULL_STAT_ATTR(lock, SCULL_STAT_LOCK);
+
+static struct attribute *stats_attrs[] = {
+	&dev_attr_read.attr.attr,
+	&dev_attr_read_hist.attr.attr,
+	&dev_attr_write.attr.attr,
+	&dev_attr_write_hist.attr.attr,
+	&dev_attr_trim.attr.attr,
+	&dev_attr_trim_hist.attr.attr,
+	&dev_attr_alloc.attr.attr,
+	&dev_attr_alloc_hist.attr.attr,
+	&dev_attr_lock.attr.attr,
+	&dev_attr_lock_hist.attr.attr,
+	NULL,
+};
+
+static const struct attribute_group stats_group = {
+	.name	= "stats",
+	.attrs	= stats_attrs,
+};
+
 static struct attribute *top_attrs[] = {
 	&dev_attr_qset.attr,
 	&dev_attr_quantum.attr,
 	&dev_attr_size.attr,
+	&dev_attr_allocated_bytes.attr,
+	&dev_attr_compress_ms.attr,
+	&dev_attr_compressed_bytes.attr,
+	&dev_attr_compress_ratio.attr,
+	&dev_attr_decompress_ns.attr,
+	&dev_attr_pending_free_bytes.attr,
+	&dev_attr_pooled_bytes.attr,
+	&dev_attr_numa_policy.attr,
+	&dev_attr_numa_allocs.attr,
+	&dev_attr_numa_resident.attr,
+	&dev_attr_sealed.attr,
+	NULL,
+};
+
+static const struct attribute_group top_group = {
+	.attrs	= top_attrs,
+};
+
+static const struct attribute_group *top_groups[] = {
+	&top_group,
+	&stats_group,
 	NULL,
 };
-ATTRIBUTE_GROUPS(top);
 
-static void __init init_driver(struct scull_driver *drv)
+static void scull_free_zstrm(struct scull_driver *drv)
+{
+	struct scull_zstrm *zs;
+	int cpu;
+
+	if (!drv->zstrm)
+		return;
+	for_each_possible_cpu(cpu) {
+		zs = per_cpu_ptr(drv->zstrm, cpu);
+		if (zs->tfm)
+			crypto_free_comp(zs->tfm);
+	}
+	free_percpu(drv->zstrm);
+	drv->zstrm = NULL;
+}
+
+static int __init scull_alloc_zstrm(struct scull_driver *drv)
+{
+	struct scull_zstrm *zs;
+	int cpu;
+
+	drv->zstrm = alloc_percpu(struct scull_zstrm);
+	if (!drv->zstrm)
+		return -ENOMEM;
+	for_each_possible_cpu(cpu) {
+		zs = per_cpu_ptr(drv->zstrm, cpu);
+		mutex_init(&zs->lock);
+		zs->tfm = crypto_alloc_comp(drv->compressor, 0, 0);
+		if (IS_ERR(zs->tfm)) {
+			zs->tfm = NULL;
+			scull_free_zstrm(drv);
+			return -ENOMEM;
+		}
+	}
+	return 0;
+}
+
+static int __init init_driver(struct scull_driver *drv)
 {
 	memset(&drv->fops, 0, sizeof(struct file_operations));
+	memset(&drv->snap_fops, 0, sizeof(struct file_operations));
+	memset(&drv->vm_ops, 0, sizeof(struct vm_operations_struct));
+	memset(&drv->shrinker, 0, sizeof(struct shrinker));
+	mutex_init(&drv->zlock);
+	mutex_init(&drv->lock);
+	drv->zbuf		= NULL;
+	drv->zstrm		= NULL;
+	/* compression is optional */
+	drv->tfm		= crypto_alloc_comp(drv->compressor, 0, 0);
+	if (IS_ERR(drv->tfm))
+		drv->tfm	= NULL;
+	else if (scull_alloc_zstrm(drv)) {
+		crypto_free_comp(drv->tfm);
+		drv->tfm	= NULL;
+	}
+	drv->shrinker.count_objects	= scull_count_objects;
+	drv->shrinker.scan_objects	= scull_scan_objects;
+	drv->shrinker.seeks	= DEFAULT_SEEKS;
+	drv->vm_ops.open	= vm_open;
+	drv->vm_ops.close	= vm_close;
+	drv->vm_ops.fault	= fault;
+	drv->vm_ops.page_mkwrite	= mkwrite;
+	drv->vm_ops.pfn_mkwrite	= mkwrite;
 	drv->type.name		= drv->base.name;
 	drv->type.groups	= top_groups;
 	drv->fops.owner		= drv->base.owner;
-	drv->fops.read		= read;
-	drv->fops.write		= write;
+	drv->fops.llseek	= llseek;
+	drv->fops.read_iter	= read_iter;
+	drv->fops.write_iter	= write_iter;
+	drv->fops.splice_read	= generic_file_splice_read;
+	drv->fops.splice_write	= iter_file_splice_write;
+	drv->fops.mmap		= mmap;
+	drv->fops.fsync		= fsync;
+	drv->fops.unlocked_ioctl	= ioctl;
+	drv->fops.compat_ioctl	= compat_ptr_ioctl;
+	drv->snap_fops.owner	= drv->base.owner;
+	drv->snap_fops.llseek	= snap_llseek;
+	drv->snap_fops.read_iter	= snap_read_iter;
+	drv->snap_fops.splice_read	= generic_file_splice_read;
+	drv->snap_fops.release	= snap_release;
 	drv->fops.open		= open;
+	drv->wq = alloc_workqueue("%s", WQ_UNBOUND, 0, drv->base.name);
+	if (!drv->wq) {
+		scull_free_zstrm(drv);
+		if (drv->tfm)
+			crypto_free_comp(drv->tfm);
+		return -ENOMEM;
+	}
+	return 0;
+}
+
+static int init_device(struct scull_driver *drv, struct scull_device *dev)
+{
+	struct scull_data *sd;
+	int i, err;
+
+	init_rwsem(&dev->lock);
+	for (i = 0; i < SCULL_NR_LOCKS; i++)
+		init_rwsem(&dev->locks[i]);
+	spin_lock_init(&dev->size_lock);
+	mutex_init(&dev->snaps_lock);
+	INIT_LIST_HEAD(&dev->snaps);
+	INIT_DELAYED_WORK(&dev->compress, scull_compress_work);
+	INIT_WORK(&dev->refill, scull_refill_work);
+	atomic64_set(&dev->decompress_nr, 0);
+	atomic64_set(&dev->decompress_ns, 0);
+	atomic_long_set(&dev->pending_free, 0);
+	dev->numa_policy = SCULL_NUMA_LOCAL;
+	dev->numa_next = NUMA_NO_NODE;
+	/* the resident counters after the allocated ones */
+	dev->numa_allocs = kcalloc(nr_node_ids*2, sizeof(atomic_long_t),
+				   GFP_KERNEL);
+	if (!dev->numa_allocs)
+		return -ENOMEM;
+	dev->numa_resident = dev->numa_allocs+nr_node_ids;
+	dev->stats = alloc_percpu(struct scull_stats);
+	if (!dev->stats) {
+		err = -ENOMEM;
+		goto free;
+	}
+	dev->pool = alloc_percpu(struct scull_pool);
+	if (!dev->pool) {
+		err = -ENOMEM;
+		goto free_stats;
+	}
+	for_each_possible_cpu(i)
+		spin_lock_init(&per_cpu_ptr(dev->pool, i)->lock);
+	err = init_srcu_struct(&dev->srcu);
+	if (err)
+		goto free_pool;
+	sd = scull_alloc_data(dev, drv->default_qset, drv->default_quantum);
+	if (!sd) {
+		err = -ENOMEM;
+		goto cleanup;
+	}
+	RCU_INIT_POINTER(dev->data, sd);
+	dev->size = 0;
+	return 0;
+cleanup:
+	cleanup_srcu_struct(&dev->srcu);
+free_pool:
+	free_percpu(dev->pool);
+free_stats:
+	free_percpu(dev->stats);
+free:
+	kfree(dev->numa_allocs);
+	return err;
+}
+
+static void term_driver(struct scull_driver *drv)
+{
+	destroy_workqueue(drv->wq);
+	scull_free_zstrm(drv);
+	if (drv->tfm)
+		crypto_free_comp(drv->tfm);
+	vfree(drv->zbuf);
+}
+
+static void term_device(struct scull_device *dev)
+{
+	cancel_delayed_work_sync(&dev->compress);
+	/* wait for the data being freed by the trim */
+	srcu_barrier(&dev->srcu);
+	flush_workqueue(scull_driver.wq);
+	scull_free_data(rcu_dereference_protected(dev->data, 1));
+	cancel_work_sync(&dev->refill);
+	scull_drain_pools(dev);
+	cleanup_srcu_struct(&dev->srcu);
+	free_percpu(dev->pool);
+	free_percpu(dev->stats);
+	kfree(dev->numa_allocs);
+	if (dev->backing)
+		filp_close(dev->backing, NULL);
+}
+
+/* scull_create() returns the storage of the given size, without the
+ * device node, for sbull. */
+struct scull_device *scull_create(loff_t size)
+{
+	struct scull_device *dev;
+	int err;
+
+	dev = kzalloc(sizeof(struct scull_device), GFP_KERNEL);
+	if (!dev)
+		return ERR_PTR(-ENOMEM);
+	err = init_device(&scull_driver, dev);
+	if (err) {
+		kfree(dev);
+		return ERR_PTR(err);
+	}
+	/* reads up to the size, where the holes read as zeros */
+	dev->size = size;
+	return dev;
+}
+EXPORT_SYMBOL(scull_create);
+
+void scull_destroy(struct scull_device *dev)
+{
+	term_device(dev);
+	kfree(dev);
 }
+EXPORT_SYMBOL(scull_destroy);
 
 static int __init init(void)
 {
 	struct scull_driver *drv = &scull_driver;
-	struct scull_device *end = drv->devs+ARRAY_SIZE(drv->devs);
-	struct scull_device *dev;
-	char name[7]; /* 10 devices */
+	struct scull_node *node, *end;
+	char name[16];
 	int i, err;
 
-	err = alloc_chrdev_region(&drv->devt, 0, ARRAY_SIZE(drv->devs),
-				  drv->base.name);
+	if (!drv->nr_devs || drv->nr_devs > MINORMASK+1)
+		return -EINVAL;
+	err = alloc_chrdev_region(&drv->devt, 0, drv->nr_devs, drv->base.name);
 	if (err)
 		return err;
-
-	init_driver(drv);
-	for (dev = drv->devs, i = 0; dev < end; dev++, i++) {
+	err = init_driver(drv);
+	if (err)
+		goto unregister;
+	err = init_device(drv, &drv->idle);
+	if (err)
+		goto term;
+	drv->nodes = kvcalloc(drv->nr_devs, sizeof(struct scull_node),
+			      GFP_KERNEL);
+	if (!drv->nodes) {
+		err = -ENOMEM;
+		goto idle;
+	}
+	cdev_init(&drv->cdev, &drv->fops);
+	drv->cdev.owner	= drv->base.owner;
+	err = cdev_add(&drv->cdev, drv->devt, drv->nr_devs);
+	if (err)
+		goto free;
+	end = drv->nodes+drv->nr_devs;
+	for (node = drv->nodes, i = 0; node < end; node++, i++) {
 		err = snprintf(name, sizeof(name), "%s%d", drv->base.name, i);
 		if (err < 0) {
-			end = dev;
-			goto err;
-		}
-		memset(dev, 0, sizeof(struct scull_device));
-		device_initialize(&dev->base);
-		cdev_init(&dev->cdev, &drv->fops);
-		mutex_init(&dev->lock);
-		dev->data		= NULL;
-		dev->size		= 0;
-		dev->qset		= drv->default_qset;
-		dev->quantum		= drv->default_quantum;
-		dev->cdev.owner		= drv->base.owner;
-		dev->base.init_name	= name;
-		dev->base.type		= &drv->type;
-		dev->base.devt		= MKDEV(MAJOR(drv->devt),
+			end = node;
+			goto del;
+		}
+		device_initialize(&node->base);
+		node->base.init_name	= name;
+		node->base.type		= &drv->type;
+		node->base.devt		= MKDEV(MAJOR(drv->devt),
 						MINOR(drv->devt)+i);
-		err = cdev_device_add(&dev->cdev, &dev->base);
+		err = device_add(&node->base);
 		if (err) {
-			end = dev;
-			goto err;
+			end = node;
+			goto del;
 		}
 	}
+	err = register_shrinker(&drv->shrinker);
+	if (err)
+		goto del;
 	return 0;
-err:
-	for (dev = drv->devs; dev < end; dev++)
-		cdev_device_del(&dev->cdev, &dev->base);
-	unregister_chrdev_region(drv->devt, ARRAY_SIZE(drv->devs));
+del:
+	for (node = drv->nodes; node < end; node++)
+		device_del(&node->base);
+	cdev_del(&drv->cdev);
+free:
+	kvfree(drv->nodes);
+idle:
+	term_device(&drv->idle);
+term:
+	term_driver(drv);
+unregister:
+	unregister_chrdev_region(drv->devt, drv->nr_devs);
 	return err;
 }
 module_init(init);
@@ -338,14 +3616,27 @@ module_init(init);
 static void __exit term(void)
 {
 	struct scull_driver *drv = &scull_driver;
-	struct scull_device *end = drv->devs+ARRAY_SIZE(drv->devs);
-	struct scull_device *dev;
+	struct scull_node *node, *end = drv->nodes+drv->nr_devs;
+	int err;
 
-	for (dev = drv->devs; dev < end; dev++) {
-		scull_trim(dev);
-		cdev_device_del(&dev->cdev, &dev->base);
+	unregister_shrinker(&drv->shrinker);
+	for (node = drv->nodes; node < end; node++)
+		device_del(&node->base);
+	cdev_del(&drv->cdev);
+	for (node = drv->nodes; node < end; node++) {
+		if (!node->dev)
+			continue;
+		err = node->dev->backing ? scull_persist(node->dev) : 0;
+		if (err)
+			pr_warn("%s%td: not persisted: %d\n", drv->base.name,
+				node-drv->nodes, err);
+		term_device(node->dev);
+		kfree(node->dev);
 	}
-	unregister_chrdev_region(drv->devt, ARRAY_SIZE(drv->devs));
+	kvfree(drv->nodes);
+	term_device(&drv->idle);
+	term_driver(drv);
+	unregister_chrdev_region(drv->devt, drv->nr_devs);
 }
 module_exit(term);
 
@@ -0,0 +1,78 @@
+/* SPDX-License-Identifier: GPL-2.0 */
+#ifndef _SCULL_H
+#define _SCULL_H
+
+#include <linux/ioctl.h>
+#include <linux/types.h>
+
+/* struct scull_falloc is the fallocate(2) range, as vfs_fallocate() is
+ * only for the regular files and the block devices.  mode takes
+ * FALLOC_FL_KEEP_SIZE, FALLOC_FL_PUNCH_HOLE and FALLOC_FL_ZERO_RANGE. */
+struct scull_falloc {
+	__u32	mode;
+	__u32	pad;	/* must be zero */
+	__u64	offset;
+	__u64	len;
+};
+
+/* struct scull_clone is issued on the destination device, in the layout
+ * of struct file_clone_range, as FICLONERANGE and copy_file_range(2) are
+ * only for the regular files.  src_length 0 goes up to the end of src. */
+struct scull_clone {
+	__s64	src_fd;
+	__u64	src_offset;
+	__u64	src_length;
+	__u64	dest_offset;
+};
+
+/* struct scull_rec is a record of SCULL_IOC_READV and SCULL_IOC_WRITEV,
+ * with the bytes done, or -errno, returned in res. */
+struct scull_rec {
+	__u64	offset;
+	__u64	len;
+	__u64	buf;	/* user buffer */
+	__s64	res;
+};
+
+/* struct scull_batch points to nr records, all done under a single
+ * lock acquisition.  The ioctl returns the number of records done. */
+struct scull_batch {
+	__u64	recs;	/* struct scull_rec array */
+	__u32	nr;	/* up to SCULL_BATCH_MAX */
+	__u32	flags;	/* must be zero */
+};
+#define SCULL_BATCH_MAX		1024
+
+#define SCULL_IOC_MAGIC		0xb5
+/* preallocates, or punches out, the range */
+#define SCULL_IOC_FALLOCATE	_IOW(SCULL_IOC_MAGIC, 1, struct scull_falloc)
+/* shares the whole quanta, and fails unless the geometry allows it */
+#define SCULL_IOC_CLONE		_IOW(SCULL_IOC_MAGIC, 2, struct scull_clone)
+/* shares what it can, and copies the rest */
+#define SCULL_IOC_COPY		_IOW(SCULL_IOC_MAGIC, 3, struct scull_clone)
+/* returns the read-only file descriptor of the point-in-time snapshot */
+#define SCULL_IOC_SNAPSHOT	_IO(SCULL_IOC_MAGIC, 4)
+/* read and write the scattered records */
+#define SCULL_IOC_READV		_IOW(SCULL_IOC_MAGIC, 5, struct scull_batch)
+#define SCULL_IOC_WRITEV	_IOW(SCULL_IOC_MAGIC, 6, struct scull_batch)
+/* makes the device immutable for the lockless readers, and back again
+ * once they are gone and nothing maps it */
+#define SCULL_IOC_SEAL		_IO(SCULL_IOC_MAGIC, 7)
+#define SCULL_IOC_UNSEAL	_IO(SCULL_IOC_MAGIC, 8)
+
+#ifdef __KERNEL__
+struct scull_device;
+struct iov_iter;
+
+/* scull storage for the other drivers, e.g. sbull */
+struct scull_device *scull_create(loff_t size);
+void scull_destroy(struct scull_device *dev);
+ssize_t scull_read_at(struct scull_device *dev, loff_t pos,
+		      struct iov_iter *iter);
+ssize_t scull_write_at(struct scull_device *dev, loff_t pos,
+		       struct iov_iter *iter);
+long scull_fallocate(struct scull_device *dev, int mode, loff_t offset,
+		     loff_t len);
+#endif /* __KERNEL__ */
+
+#endif /* _SCULL_H */
@@ -7,15 +7,19 @@
 #include <linux/cdev.h>
 #include <linux/sysfs.h>
 #include <linux/device.h>
+#include <linux/moduleparam.h>
 #include <linux/mutex.h>
 #include <linux/slab.h>
+#include <linux/bitops.h>
+#include <linux/falloc.h>
 #include <linux/uaccess.h>
 
-#define QUANTUM_SHIFT	PAGE_SHIFT
+#include "scull.h"
+
 #define QUANTUM_SIZE	PAGE_SIZE
-#define QVEC_SHIFT	(QUANTUM_SHIFT+9)
-#define QVEC_SIZE	(1L << QVEC_SHIFT)
-#define PTRS_PER_QVEC	PAGE_SIZE/sizeof(void *)
+#define QUANTUM_MAX	(16*PAGE_SIZE)
+#define PTRS_PER_QVEC	(PAGE_SIZE/sizeof(void *))
+#define BULK_MAX	16	/* objects in a single bulk call */
 
 struct scullc_qvec {
 	void	*qvec[PTRS_PER_QVEC];
@@ -29,14 +33,16 @@ struct scullc_qset {
 struct scullc_device {
 	struct mutex		lock;
 	struct scullc_qset	*qset;
+	size_t			size;
+	size_t			quantum;
+	struct kmem_cache	*quantums;	/* of the quantum size */
 	struct cdev		cdev;
 	struct device		base;
 };
 
 static struct scullc_driver {
 	int			qset_size;
-	size_t			quantum_size;
-	struct kmem_cache	*quantums;
+	size_t			quantum_size;	/* default */
 	struct kmem_cache	*qvecs;
 	struct kmem_cache	*qsets;
 	dev_t			devt;
@@ -50,60 +56,128 @@ static struct scullc_driver {
 	.base.owner	= THIS_MODULE,
 };
 
-static struct scullc_qset *alloc_qset(struct scullc_driver *drv)
+/* bytes covered by a qset */
+static inline loff_t qvec_size(const struct scullc_device *dev)
 {
-	struct scullc_qset *qset;
-	struct scullc_qvec *qvec;
+	return (loff_t)PTRS_PER_QVEC*dev->quantum;
+}
+
+/* create_quantums() returns the lookaside cache of the quantum size for
+ * the named device.  The size is in the cache name, as the old cache is
+ * still there when the quantum size changes. */
+static struct kmem_cache *create_quantums(const char *name, size_t quantum)
+{
+	char cname[32];
+
+	snprintf(cname, sizeof(cname), "%s_quantum_%zu", name, quantum);
+	return kmem_cache_create(cname, quantum, __alignof__(size_t), 0, NULL);
+}
 
-	qvec = kmem_cache_zalloc(drv->qvecs, GFP_KERNEL);
-	if (!qvec)
+/* alloc_qsets() links nr new qsets at qsetp, and returns the last one. */
+static struct scullc_qset *alloc_qsets(struct scullc_driver *drv,
+				       struct scullc_qset **qsetp, size_t nr)
+{
+	void *qsets[BULK_MAX], *qvecs[BULK_MAX];
+	struct scullc_qset *qset = NULL;
+	size_t i;
+
+	if (!kmem_cache_alloc_bulk(drv->qsets, GFP_KERNEL, nr, qsets))
 		return NULL;
-	qset = kmem_cache_zalloc(drv->qsets, GFP_KERNEL);
-	if (!qset) {
-		kmem_cache_free(drv->qvecs, qvec);
+	if (!kmem_cache_alloc_bulk(drv->qvecs, GFP_KERNEL, nr, qvecs)) {
+		kmem_cache_free_bulk(drv->qsets, nr, qsets);
 		return NULL;
 	}
-	qset->vec = qvec;
+	for (i = 0; i < nr; i++) {
+		qset = qsets[i];
+		qset->vec = memset(qvecs[i], 0, sizeof(struct scullc_qvec));
+		qset->next = NULL;
+		*qsetp = qset;
+		qsetp = &qset->next;
+	}
 	return qset;
 }
 
-static void free_qset(struct scullc_driver *drv, struct scullc_qset *qset)
+/* alloc_quanta() fills the empty slots out of the nr ones from q at
+ * once, and marks the new, uninitialized, quanta in fresh. */
+static int alloc_quanta(struct scullc_device *dev, void **q, int nr,
+			unsigned long *fresh)
 {
-	if (likely(qset->vec)) {
-		void **q = qset->vec->qvec;
-		void **end = q+PTRS_PER_QVEC;
-		while (q != end) {
-			if (*q)
-				kmem_cache_free(drv->quantums, *q);
-			q++;
+	void *quanta[BULK_MAX];
+	int i, n = 0;
+
+	BUILD_BUG_ON(BULK_MAX > BITS_PER_LONG);
+	*fresh = 0;
+	for (i = 0; i < nr; i++)
+		if (!q[i]) {
+			__set_bit(i, fresh);
+			n++;
 		}
-		kmem_cache_free(drv->qvecs, qset->vec);
+	if (!n)
+		return 0;
+	if (!kmem_cache_alloc_bulk(dev->quantums, GFP_KERNEL, n, quanta))
+		return -ENOMEM;
+	n = 0;
+	for_each_set_bit(i, fresh, nr)
+		q[i] = quanta[n++];
+	return 0;
+}
+
+/* put_quanta() gives the fresh quanta back, and empties the slots. */
+static void put_quanta(struct scullc_device *dev, void **q, int nr,
+		       unsigned long fresh)
+{
+	void *quanta[BULK_MAX];
+	int i, n = 0;
+
+	for_each_set_bit(i, &fresh, nr) {
+		quanta[n++] = q[i];
+		q[i] = NULL;
 	}
-	kmem_cache_free(drv->qsets, qset);
+	if (n)
+		kmem_cache_free_bulk(dev->quantums, n, quanta);
+}
+
+/* free_quanta() packs the quanta at the head of the vector, and frees
+ * them all in a single call. */
+static void free_quanta(struct scullc_device *dev, struct scullc_qvec *vec)
+{
+	size_t i, nr = 0;
+
+	for (i = 0; i < PTRS_PER_QVEC; i++)
+		if (vec->qvec[i])
+			vec->qvec[nr++] = vec->qvec[i];
+	if (nr)
+		kmem_cache_free_bulk(dev->quantums, nr, vec->qvec);
 }
 
-static struct scullc_qset *follow(struct scullc_device *dev, loff_t pos)
+/* follow() returns the qset covering pos, allocating the missing ones
+ * on the way for the writer, or NULL for the reader. */
+static struct scullc_qset *follow(struct scullc_device *dev, loff_t pos,
+				  bool alloc)
 {
 	struct scullc_driver *drv = container_of(dev->base.driver,
 						 struct scullc_driver,
 						 base);
-	int i, qset_pos = pos/QVEC_SIZE;
-	struct scullc_qset *newp, **qsetp = &dev->qset;
+	struct scullc_qset *qset, **qsetp = &dev->qset;
+	loff_t i, qset_pos = pos/qvec_size(dev);
+	size_t nr;
 
-	for (i = 0; i < qset_pos; i++) {
-		if (*qsetp) {
-			qsetp = &(*qsetp)->next;
-			continue;
-		}
-		newp = alloc_qset(drv);
-		if (!newp)
+	for (i = 0; *qsetp; i++) {
+		if (i == qset_pos)
+			return *qsetp;
+		qsetp = &(*qsetp)->next;
+	}
+	if (!alloc)
+		return NULL;
+	/* the chain has no gaps, so the missing ones are all at the tail */
+	for (qset = NULL; i <= qset_pos; i += nr) {
+		nr = min_t(loff_t, qset_pos-i+1, BULK_MAX);
+		qset = alloc_qsets(drv, qsetp, nr);
+		if (!qset)
 			return NULL;
-		*qsetp = newp;
-		qsetp = &newp->next;
+		qsetp = &qset->next;
 	}
-	if (!*qsetp)
-		*qsetp = alloc_qset(drv);
-	return *qsetp;
+	return qset;
 }
 
 static void trim(struct scullc_device *dev)
@@ -111,66 +185,208 @@ static void trim(struct scullc_device *dev)
 	struct scullc_driver *drv = container_of(dev->base.driver,
 						 struct scullc_driver,
 						 base);
+	void *qsets[BULK_MAX], *qvecs[BULK_MAX];
 	struct scullc_qset *nextp, *qset;
+	size_t nr = 0;
 
 	for (qset = dev->qset; qset; qset = nextp) {
 		nextp = qset->next;
-		free_qset(drv, qset);
+		free_quanta(dev, qset->vec);
+		qvecs[nr] = qset->vec;
+		qsets[nr++] = qset;
+		if (nr == BULK_MAX || !nextp) {
+			kmem_cache_free_bulk(drv->qvecs, nr, qvecs);
+			kmem_cache_free_bulk(drv->qsets, nr, qsets);
+			nr = 0;
+		}
 	}
+	dev->qset = NULL;
+	dev->size = 0;
 }
 
-static ssize_t read(struct file *fp, char *__user buf, size_t count, loff_t *pos)
+static loff_t llseek(struct file *fp, loff_t offset, int whence)
 {
 	struct scullc_device *dev = fp->private_data;
-	printk(KERN_DEBUG "read[%s:%s]\n", dev->base.driver->name,
-	       dev_name(&dev->base));
-	return 0;
+	loff_t ret;
+
+	if (mutex_lock_interruptible(&dev->lock))
+		return -ERESTARTSYS;
+	switch (whence) {
+	case SEEK_SET:
+		break;
+	case SEEK_CUR:
+		offset += fp->f_pos;
+		break;
+	case SEEK_END:
+		offset += dev->size;
+		break;
+	default:
+		ret = -EINVAL;
+		goto out;
+	}
+	if (offset < 0) {
+		ret = -EINVAL;
+		goto out;
+	}
+	fp->f_pos = offset;
+	ret = offset;
+out:
+	mutex_unlock(&dev->lock);
+	return ret;
 }
 
-static ssize_t write(struct file *fp, const char *__user buf, size_t count, loff_t *pos)
+/* read() does up to a quantum at a time. */
+static ssize_t read(struct file *fp, char __user *buf, size_t count, loff_t *pos)
 {
 	struct scullc_device *dev = fp->private_data;
-	struct scullc_driver *drv = container_of(dev->base.driver,
-						 struct scullc_driver,
-						 base);
-	size_t qpos = (*pos+1)%QVEC_SIZE/QUANTUM_SIZE;
-	size_t offset = *pos%QUANTUM_SIZE;
+	size_t offset = *pos%dev->quantum;
 	struct scullc_qset *qset;
-	void **data;
-	size_t rem;
-	void *ptr;
-	int ret;
+	void *data = NULL;
+	ssize_t ret = 0;
 
 	if (mutex_lock_interruptible(&dev->lock))
 		return -ERESTARTSYS;
-	qset = follow(dev, *pos);
+	if (*pos >= dev->size)
+		goto out;
+	if (count > dev->size-*pos)
+		count = dev->size-*pos;
+	if (count > dev->quantum-offset)
+		count = dev->quantum-offset;
+	qset = follow(dev, *pos, false);
+	if (qset)
+		data = qset->vec->qvec[*pos%qvec_size(dev)/dev->quantum];
+	/* holes are read as zeros */
+	if (data)
+		ret = copy_to_user(buf, data+offset, count);
+	else
+		ret = clear_user(buf, count);
+	if (ret) {
+		ret = -EFAULT;
+		goto out;
+	}
+	*pos += count;
+	ret = count;
+out:
+	mutex_unlock(&dev->lock);
+	return ret;
+}
+
+/* write() goes up to BULK_MAX quanta in the qset, allocated at once. */
+static ssize_t write(struct file *fp, const char __user *buf, size_t count, loff_t *pos)
+{
+	struct scullc_device *dev = fp->private_data;
+	size_t offset = *pos%dev->quantum, len = 0, left = 0, done = 0;
+	struct scullc_qset *qset;
+	unsigned long fresh;
+	ssize_t ret;
+	void **q;
+	int i, nr;
+
+	if (!count)
+		return 0;
+	if (mutex_lock_interruptible(&dev->lock))
+		return -ERESTARTSYS;
+	qset = follow(dev, *pos, true);
 	if (!qset) {
 		ret = -ENOMEM;
 		goto out;
 	}
-	data = &qset->vec->qvec[qpos];
-	if (!*data)
-		*data = kmem_cache_zalloc(drv->quantums, GFP_KERNEL);
-	if (!*data) {
-		ret = -ENOMEM;
+	q = &qset->vec->qvec[*pos%qvec_size(dev)/dev->quantum];
+	nr = min_t(size_t, DIV_ROUND_UP(offset+count, dev->quantum), BULK_MAX);
+	nr = min_t(int, nr, qset->vec->qvec+PTRS_PER_QVEC-q);
+	if (count > nr*dev->quantum-offset)
+		count = nr*dev->quantum-offset;
+	ret = alloc_quanta(dev, q, nr, &fresh);
+	if (ret)
 		goto out;
+	for (i = 0; i < nr; i++, offset = 0) {
+		len = min(count-done, dev->quantum-offset);
+		/* holes around the new data are read as zeros */
+		if (test_bit(i, &fresh)) {
+			memset(q[i], 0, offset);
+			memset(q[i]+offset+len, 0, dev->quantum-offset-len);
+		}
+		left = copy_from_user(q[i]+offset, buf+done, len);
+		done += len-left;
+		if (left)
+			break;
 	}
-	if (offset+count > QUANTUM_SIZE)
-		count = QUANTUM_SIZE - offset;
-	ptr = *data+offset;
-	rem = count;
-	do {
-		size_t len = copy_from_user(ptr, buf, rem);
-		ptr += rem-len;
-		buf += rem-len;
-		rem = len;
-	} while (rem);
-	ret = count;
+	if (i < nr) {
+		if (test_bit(i, &fresh))
+			memset(q[i]+offset+len-left, 0, left);
+		put_quanta(dev, q+i+1, nr-i-1, fresh >> (i+1));
+	}
+	if (!done) {
+		ret = -EFAULT;
+		goto out;
+	}
+	*pos += done;
+	if (dev->size < *pos)
+		dev->size = *pos;
+	ret = done;
 out:
 	mutex_unlock(&dev->lock);
 	return ret;
 }
 
+/* fallocate() preallocates the zeroed quanta, BULK_MAX at a time. */
+static long fallocate(struct file *fp, int mode, loff_t offset, loff_t len)
+{
+	struct scullc_device *dev = fp->private_data;
+	struct scullc_qset *qset = NULL;
+	loff_t pos, end = offset+len;
+	unsigned long fresh;
+	long err = 0;
+	void **q;
+	int i, nr;
+
+	if (mode&~FALLOC_FL_KEEP_SIZE)
+		return -EOPNOTSUPP;
+	if (mutex_lock_interruptible(&dev->lock))
+		return -ERESTARTSYS;
+	for (pos = offset-offset%dev->quantum; pos < end;
+	     pos += nr*dev->quantum) {
+		/* the batches never cross the qset boundary */
+		if (!qset || !(pos%qvec_size(dev)))
+			qset = follow(dev, pos, true);
+		if (!qset) {
+			err = -ENOMEM;
+			break;
+		}
+		q = &qset->vec->qvec[pos%qvec_size(dev)/dev->quantum];
+		nr = min_t(loff_t, DIV_ROUND_UP(end-pos, dev->quantum),
+			   BULK_MAX);
+		nr = min_t(int, nr, qset->vec->qvec+PTRS_PER_QVEC-q);
+		err = alloc_quanta(dev, q, nr, &fresh);
+		if (err)
+			break;
+		for_each_set_bit(i, &fresh, nr)
+			memset(q[i], 0, dev->quantum);
+	}
+	if (!err && !(mode&FALLOC_FL_KEEP_SIZE) && dev->size < end)
+		dev->size = end;
+	mutex_unlock(&dev->lock);
+	return err;
+}
+
+/* ioctl() takes SCULL_IOC_FALLOCATE, as vfs_fallocate() does not take
+ * the character devices. */
+static long ioctl(struct file *fp, unsigned int cmd, unsigned long arg)
+{
+	struct scull_falloc fa;
+
+	if (cmd != SCULL_IOC_FALLOCATE)
+		return -ENOTTY;
+	if (!(fp->f_mode&FMODE_WRITE))
+		return -EBADF;
+	if (copy_from_user(&fa, (void __user *)arg, sizeof(fa)))
+		return -EFAULT;
+	if (fa.pad || !fa.len || fa.offset > LLONG_MAX ||
+	    fa.len > LLONG_MAX-fa.offset)
+		return -EINVAL;
+	return fallocate(fp, fa.mode, fa.offset, fa.len);
+}
+
 static int open(struct inode *ip, struct file *fp)
 {
 	struct scullc_device *dev = container_of(ip->i_cdev,
@@ -180,7 +396,7 @@ static int open(struct inode *ip, struct file *fp)
 	if (mutex_lock_interruptible(&dev->lock))
 		return -ERESTARTSYS;
 	fp->private_data = dev;
-	if (fp->f_flags&O_TRUNC)
+	if ((fp->f_flags&O_ACCMODE) != O_RDONLY && fp->f_flags&O_TRUNC)
 		trim(dev);
 	mutex_unlock(&dev->lock);
 	return 0;
@@ -190,12 +406,53 @@ static ssize_t quantum_size_show(struct device *base,
 				 struct device_attribute *attr,
 				 char *page)
 {
-	const struct scullc_driver *drv = container_of(base->driver,
-						       struct scullc_driver,
-						       base);
-	return snprintf(page, PAGE_SIZE, "%ld\n", drv->quantum_size);
+	struct scullc_device *dev = container_of(base,
+						 struct scullc_device,
+						 base);
+	size_t quantum;
+
+	if (mutex_lock_interruptible(&dev->lock))
+		return -ERESTARTSYS;
+	quantum = dev->quantum;
+	mutex_unlock(&dev->lock);
+	return snprintf(page, PAGE_SIZE, "%ld\n", quantum);
+}
+
+/* the new quantum size trims the device, and comes with its own cache */
+static ssize_t quantum_size_store(struct device *base,
+				  struct device_attribute *attr,
+				  const char *page, size_t count)
+{
+	struct scullc_device *dev = container_of(base,
+						 struct scullc_device,
+						 base);
+	struct kmem_cache *cache;
+	unsigned long quantum;
+	int err;
+
+	err = kstrtoul(page, 10, &quantum);
+	if (err)
+		return err;
+	if (!quantum || quantum > QUANTUM_MAX)
+		return -EINVAL;
+	if (mutex_lock_interruptible(&dev->lock))
+		return -ERESTARTSYS;
+	if (quantum == dev->quantum)
+		goto out;
+	cache = create_quantums(dev_name(base), quantum);
+	if (!cache) {
+		err = -ENOMEM;
+		goto out;
+	}
+	trim(dev);
+	kmem_cache_destroy(dev->quantums);
+	dev->quantums = cache;
+	dev->quantum = quantum;
+out:
+	mutex_unlock(&dev->lock);
+	return err ? err : count;
 }
-static DEVICE_ATTR_RO(quantum_size);
+static DEVICE_ATTR_RW(quantum_size);
 
 static ssize_t qset_size_show(struct device *base,
 			      struct device_attribute *attr,
@@ -241,35 +498,28 @@ static int init_driver(struct scullc_driver *drv)
 	int err;
 
 	cache = KMEM_CACHE(scullc_qset, 0);
-	if (IS_ERR(cache))
-		return PTR_ERR(cache);
+	if (!cache)
+		return -ENOMEM;
 	drv->qsets = cache;
 	cache = KMEM_CACHE(scullc_qvec, 0);
-	if (IS_ERR(cache)) {
-		err = PTR_ERR(cache);
+	if (!cache) {
+		err = -ENOMEM;
 		goto err;
 	}
 	drv->qvecs = cache;
-	cache = kmem_cache_create("scullc_quantum", drv->quantum_size,
-				  __alignof__(drv->quantum_size), 0, NULL);
-	if (IS_ERR(cache)) {
-		err = PTR_ERR(cache);
-		goto err;
-	}
-	drv->quantums = cache;
 	err = alloc_chrdev_region(&drv->devt, 0, ARRAY_SIZE(drv->devs),
 				  drv->base.name);
 	if (err)
 		goto err;
 	memset(&drv->fops, 0, sizeof(struct file_operations));
-	drv->fops.owner	= drv->base.owner;
-	drv->fops.read	= read;
-	drv->fops.write	= write;
-	drv->fops.open	= open;
+	drv->fops.owner		= drv->base.owner;
+	drv->fops.llseek	= llseek;
+	drv->fops.read		= read;
+	drv->fops.write		= write;
+	drv->fops.unlocked_ioctl	= ioctl;
+	drv->fops.open		= open;
 	return 0;
 err:
-	if (drv->quantums)
-		kmem_cache_destroy(drv->quantums);
 	if (drv->qvecs)
 		kmem_cache_destroy(drv->qvecs);
 	if (drv->qsets)
@@ -296,6 +546,14 @@ static int __init init(void)
 		}
 		mutex_init(&dev->lock);
 		dev->qset		= NULL;
+		dev->size		= 0;
+		dev->quantum		= drv->quantum_size;
+		dev->quantums		= create_quantums(name, dev->quantum);
+		if (!dev->quantums) {
+			err = -ENOMEM;
+			end = dev;
+			goto err;
+		}
 		cdev_init(&dev->cdev, &drv->fops);
 		device_initialize(&dev->base);
 		dev->base.devt		= MKDEV(MAJOR(drv->devt),
@@ -305,16 +563,18 @@ static int __init init(void)
 		dev->base.groups	= scullc_groups;
 		err = cdev_device_add(&dev->cdev, &dev->base);
 		if (err) {
+			kmem_cache_destroy(dev->quantums);
 			end = dev;
 			goto err;
 		}
 	}
 	return 0;
 err:
-	for (dev = drv->devs; dev != end; dev++)
+	for (dev = drv->devs; dev != end; dev++) {
 		cdev_device_del(&dev->cdev, &dev->base);
+		kmem_cache_destroy(dev->quantums);
+	}
 	unregister_chrdev_region(drv->devt, ARRAY_SIZE(drv->devs));
-	kmem_cache_destroy(drv->quantums);
 	kmem_cache_destroy(drv->qvecs);
 	kmem_cache_destroy(drv->qsets);
 	return err;
@@ -330,9 +590,9 @@ static void __exit term(void)
 	for (dev = drv->devs; dev != end; dev++) {
 		cdev_device_del(&dev->cdev, &dev->base);
 		trim(dev);
+		kmem_cache_destroy(dev->quantums);
 	}
 	unregister_chrdev_region(drv->devt, ARRAY_SIZE(drv->devs));
-	kmem_cache_destroy(drv->quantums);
 	kmem_cache_destroy(drv->qvecs);
 	kmem_cache_destroy(drv->qsets);
 }
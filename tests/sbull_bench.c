@@ -0,0 +1,234 @@
+/* SPDX-License-Identifier: GPL-2.0 */
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <limits.h>
+#include <fcntl.h>
+#include <errno.h>
+#include <time.h>
+#include <unistd.h>
+#include <sys/types.h>
+#include <sys/mman.h>
+#include <sys/syscall.h>
+#include <linux/io_uring.h>
+
+struct bench {
+	const char	*const name;
+	const char	*const dev;
+	size_t		size;	/* device size to fill in */
+	size_t		bsize;	/* I/O block size */
+	unsigned int	depth;	/* reads in flight */
+	int		poll;	/* IORING_SETUP_IOPOLL */
+	unsigned int	secs;
+};
+
+/* io_uring(7) without liburing */
+struct ring {
+	int			fd;
+	unsigned int		*sq_tail;
+	unsigned int		sq_mask;
+	unsigned int		*sq_array;
+	struct io_uring_sqe	*sqes;
+	unsigned int		*cq_head;
+	unsigned int		*cq_tail;
+	unsigned int		cq_mask;
+	struct io_uring_cqe	*cqes;
+};
+
+static int setup(struct ring *r, unsigned int entries, unsigned int flags)
+{
+	struct io_uring_params p;
+	void *sq, *cq;
+
+	memset(&p, 0, sizeof(p));
+	p.flags = flags;
+	r->fd = syscall(__NR_io_uring_setup, entries, &p);
+	if (r->fd == -1)
+		return -1;
+	sq = mmap(NULL, p.sq_off.array+p.sq_entries*sizeof(unsigned int),
+		  PROT_READ|PROT_WRITE, MAP_SHARED|MAP_POPULATE, r->fd,
+		  IORING_OFF_SQ_RING);
+	if (sq == MAP_FAILED)
+		return -1;
+	cq = mmap(NULL, p.cq_off.cqes+p.cq_entries*sizeof(struct io_uring_cqe),
+		  PROT_READ|PROT_WRITE, MAP_SHARED|MAP_POPULATE, r->fd,
+		  IORING_OFF_CQ_RING);
+	if (cq == MAP_FAILED)
+		return -1;
+	r->sqes = mmap(NULL, p.sq_entries*sizeof(struct io_uring_sqe),
+		       PROT_READ|PROT_WRITE, MAP_SHARED|MAP_POPULATE, r->fd,
+		       IORING_OFF_SQES);
+	if (r->sqes == MAP_FAILED)
+		return -1;
+	r->sq_tail = sq+p.sq_off.tail;
+	r->sq_mask = *(unsigned int *)(sq+p.sq_off.ring_mask);
+	r->sq_array = sq+p.sq_off.array;
+	r->cq_head = cq+p.cq_off.head;
+	r->cq_tail = cq+p.cq_off.tail;
+	r->cq_mask = *(unsigned int *)(cq+p.cq_off.ring_mask);
+	r->cqes = cq+p.cq_off.cqes;
+	return 0;
+}
+
+static void queue(struct ring *r, int fd, void *buf, size_t len, off_t off,
+		  unsigned long long data)
+{
+	unsigned int tail = *r->sq_tail, i = tail&r->sq_mask;
+	struct io_uring_sqe *sqe = &r->sqes[i];
+
+	memset(sqe, 0, sizeof(*sqe));
+	sqe->opcode = IORING_OP_READ;
+	sqe->fd = fd;
+	sqe->addr = (unsigned long)buf;
+	sqe->len = len;
+	sqe->off = off;
+	sqe->user_data = data;
+	r->sq_array[i] = i;
+	__atomic_store_n(r->sq_tail, tail+1, __ATOMIC_RELEASE);
+}
+
+/* run the random reads for the duration and return ops/sec */
+static double bench(const struct bench *restrict b, const char *path)
+{
+	unsigned int head, tail, seed = 1, submit, i;
+	size_t nr = b->size/b->bsize;
+	struct timespec now, end;
+	unsigned long ops = 0;
+	struct io_uring_cqe *cqe;
+	struct ring r;
+	char *bufs;
+	int fd;
+
+	fd = open(path, O_RDONLY|O_DIRECT);
+	if (fd == -1)
+		goto perr;
+	if (setup(&r, b->depth, b->poll ? IORING_SETUP_IOPOLL : 0))
+		goto perr;
+	if (posix_memalign((void **)&bufs, 4096, b->bsize*b->depth))
+		goto perr;
+	for (i = 0; i < b->depth; i++)
+		queue(&r, fd, bufs+b->bsize*i, b->bsize,
+		      (rand_r(&seed)%nr)*b->bsize, i);
+	submit = b->depth;
+	clock_gettime(CLOCK_MONOTONIC, &end);
+	end.tv_sec += b->secs;
+	do {
+		/* the polled ring spins in here instead of sleeping */
+		if (syscall(__NR_io_uring_enter, r.fd, submit, 1,
+			    IORING_ENTER_GETEVENTS, NULL, 0) == -1)
+			goto perr;
+		submit = 0;
+		head = *r.cq_head;
+		tail = __atomic_load_n(r.cq_tail, __ATOMIC_ACQUIRE);
+		for (; head != tail; head++) {
+			cqe = &r.cqes[head&r.cq_mask];
+			if (cqe->res != b->bsize) {
+				errno = cqe->res < 0 ? -cqe->res : EIO;
+				goto perr;
+			}
+			i = cqe->user_data;
+			queue(&r, fd, bufs+b->bsize*i, b->bsize,
+			      (rand_r(&seed)%nr)*b->bsize, i);
+			submit++;
+			ops++;
+		}
+		__atomic_store_n(r.cq_head, head, __ATOMIC_RELEASE);
+		clock_gettime(CLOCK_MONOTONIC, &now);
+	} while (now.tv_sec < end.tv_sec ||
+		 (now.tv_sec == end.tv_sec && now.tv_nsec < end.tv_nsec));
+	close(r.fd);
+	close(fd);
+	free(bufs);
+	return (double)ops/b->secs;
+perr:
+	perror(b->name);
+	exit(EXIT_FAILURE);
+}
+
+static int fill(const struct bench *restrict b, const char *path)
+{
+	char buf[BUFSIZ];
+	size_t rem;
+	ssize_t ret;
+	int fd;
+
+	fd = open(path, O_WRONLY);
+	if (fd == -1)
+		return -1;
+	memset(buf, 0xa5, sizeof(buf));
+	for (rem = b->size; rem; rem -= ret) {
+		ret = write(fd, buf, rem < sizeof(buf) ? rem : sizeof(buf));
+		if (ret == -1) {
+			close(fd);
+			return -1;
+		}
+	}
+	if (fsync(fd)) {
+		close(fd);
+		return -1;
+	}
+	return close(fd);
+}
+
+int main(void)
+{
+	const struct bench *b, benches[] = {
+		{
+			.name	= "sbull0 4KiB random read, interrupt",
+			.dev	= "sbull0",
+			.size	= 64*1024*1024,
+			.bsize	= 4096,
+			.depth	= 1,
+			.poll	= 0,
+			.secs	= 1,
+		},
+		{
+			.name	= "sbull0 4KiB random read, polled",
+			.dev	= "sbull0",
+			.size	= 64*1024*1024,
+			.bsize	= 4096,
+			.depth	= 1,
+			.poll	= 1,
+			.secs	= 1,
+		},
+		{
+			.name	= "sbull0 4KiB random read, interrupt",
+			.dev	= "sbull0",
+			.size	= 64*1024*1024,
+			.bsize	= 4096,
+			.depth	= 32,
+			.poll	= 0,
+			.secs	= 1,
+		},
+		{
+			.name	= "sbull0 4KiB random read, polled",
+			.dev	= "sbull0",
+			.size	= 64*1024*1024,
+			.bsize	= 4096,
+			.depth	= 32,
+			.poll	= 1,
+			.secs	= 1,
+		},
+		{.name = NULL}, /* sentry */
+	};
+	char path[PATH_MAX];
+	double ops;
+	int ret;
+
+	printf("%-40s %6s %12s %10s\n", "bench", "depth", "IOPS", "usec");
+	for (b = benches; b->name; b++) {
+		ret = snprintf(path, sizeof(path), "/dev/%s", b->dev);
+		if (ret < 0)
+			goto perr;
+		if (b == benches && fill(b, path))
+			goto perr;
+		ops = bench(b, path);
+		/* Little's law for the average latency */
+		printf("%-40s %6u %12.0f %10.2f\n", b->name, b->depth, ops,
+		       1000000.0*b->depth/ops);
+	}
+	return EXIT_SUCCESS;
+perr:
+	perror(b->name);
+	return EXIT_FAILURE;
+}
@@ -0,0 +1,229 @@
+/* SPDX-License-Identifier: GPL-2.0 */
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <limits.h>
+#include <fcntl.h>
+#include <errno.h>
+#include <dirent.h>
+#include <unistd.h>
+#include <stdint.h>
+#include <sys/types.h>
+#include <sys/wait.h>
+#include <sys/ioctl.h>
+#include <linux/fs.h>
+#include "kselftest.h"
+
+struct test {
+	const char	*const name;
+	const char	*const dev;
+	int		flags;
+	off_t		offset;
+	size_t		len;
+	int		discard;	/* BLKDISCARD after the read */
+	char		mark[4];
+};
+
+static long attr(const char *dev, const char *name)
+{
+	char path[PATH_MAX], buf[BUFSIZ];
+	FILE *fp;
+	int ret;
+
+	snprintf(path, sizeof(path), "/sys/block/%s/%s", dev, name);
+	fp = fopen(path, "r");
+	if (!fp)
+		return -1;
+	ret = fread(buf, 1, sizeof(buf)-1, fp);
+	fclose(fp);
+	if (ret <= 0)
+		return -1;
+	buf[ret] = '\0';
+	return strtol(buf, NULL, 10);
+}
+
+/* return the number of the hardware queues */
+static long queues(const char *dev)
+{
+	char path[PATH_MAX];
+	struct dirent *d;
+	long nr = 0;
+	DIR *dir;
+
+	snprintf(path, sizeof(path), "/sys/block/%s/mq", dev);
+	dir = opendir(path);
+	if (!dir)
+		return -1;
+	while ((d = readdir(dir)))
+		if (d->d_name[0] != '.')
+			nr++;
+	closedir(dir);
+	return nr;
+}
+
+static void test(const struct test *restrict t)
+{
+	char path[PATH_MAX];
+	uint64_t size, range[2];
+	char *buf;
+	long got;
+	size_t i;
+	int fd;
+
+	got = attr(t->dev, "queue/logical_block_size");
+	if (got != 512) {
+		fprintf(stderr, "%s: unexpected logical block size: %ld\n",
+			t->name, got);
+		goto err;
+	}
+	got = queues(t->dev);
+	/* plus the poll queue */
+	if (got < sysconf(_SC_NPROCESSORS_ONLN)+1) {
+		fprintf(stderr, "%s: unexpected hardware queues: %ld\n",
+			t->name, got);
+		goto err;
+	}
+	if (attr(t->dev, "queue/discard_granularity") <= 0) {
+		fprintf(stderr, "%s: no discard\n", t->name);
+		goto err;
+	}
+	if (attr(t->dev, "queue/io_poll") != 1) {
+		fprintf(stderr, "%s: no poll queue\n", t->name);
+		goto err;
+	}
+	if (posix_memalign((void **)&buf, 4096, t->len))
+		goto perr;
+	snprintf(path, sizeof(path), "/dev/%s", t->dev);
+	fd = open(path, t->flags);
+	if (fd == -1)
+		goto perr;
+	if (ioctl(fd, BLKGETSIZE64, &size))
+		goto perr;
+	if (size != 256*1024*1024) {
+		fprintf(stderr, "%s: unexpected size: %ld\n", t->name,
+			(long)size);
+		goto err;
+	}
+	for (i = 0; i < t->len; i++)
+		buf[i] = t->mark[i%sizeof(t->mark)];
+	if (pwrite(fd, buf, t->len, t->offset) != t->len)
+		goto perr;
+	if (fsync(fd))
+		goto perr;
+	memset(buf, 0, t->len);
+	if (pread(fd, buf, t->len, t->offset) != t->len)
+		goto perr;
+	for (i = 0; i < t->len; i++)
+		if (buf[i] != t->mark[i%sizeof(t->mark)]) {
+			fprintf(stderr, "%s: unexpected data at %ld\n",
+				t->name, t->offset+i);
+			goto err;
+		}
+	/* the discarded range reads as zeros */
+	if (t->discard) {
+		range[0] = t->offset;
+		range[1] = t->len;
+		if (ioctl(fd, BLKDISCARD, range))
+			goto perr;
+		if (pread(fd, buf, t->len, t->offset) != t->len)
+			goto perr;
+		for (i = 0; i < t->len; i++)
+			if (buf[i]) {
+				fprintf(stderr, "%s: unexpected data at %ld after the discard\n",
+					t->name, t->offset+i);
+				goto err;
+			}
+	}
+	if (close(fd))
+		goto perr;
+	free(buf);
+	exit(EXIT_SUCCESS);
+perr:
+	perror(t->name);
+err:
+	exit(EXIT_FAILURE);
+}
+
+int main(void)
+{
+	const struct test *t, tests[] = {
+		{
+			.name		= "sbull0 4096 write/read",
+			.dev		= "sbull0",
+			.flags		= O_RDWR,
+			.offset		= 0,
+			.len		= 4096,
+			.mark		= {0x1b, 0xad, 0xbe, 0xef},
+		},
+		{
+			.name		= "sbull0 512 write/read at 1536",
+			.dev		= "sbull0",
+			.flags		= O_RDWR,
+			.offset		= 1536,
+			.len		= 512,
+			.mark		= {0x2b, 0xad, 0xbe, 0xef},
+		},
+		{
+			.name		= "sbull0 1048576 O_DIRECT write/read",
+			.dev		= "sbull0",
+			.flags		= O_RDWR|O_DIRECT,
+			.offset		= 4096,
+			.len		= 1048576,
+			.mark		= {0x3b, 0xad, 0xbe, 0xef},
+		},
+		{
+			.name		= "sbull0 1048576 O_DIRECT write/read/discard",
+			.dev		= "sbull0",
+			.flags		= O_RDWR|O_DIRECT,
+			.offset		= 2*1048576,
+			.len		= 1048576,
+			.discard	= 1,
+			.mark		= {0x4b, 0xad, 0xbe, 0xef},
+		},
+		{
+			.name		= "sbull0 1048576 O_DIRECT write/read at the end",
+			.dev		= "sbull0",
+			.flags		= O_RDWR|O_DIRECT,
+			.offset		= 255*1048576,
+			.len		= 1048576,
+			.mark		= {0x5b, 0xad, 0xbe, 0xef},
+		},
+		{.name = NULL},
+	};
+
+	for (t = tests; t->name; t++) {
+		int ret, status;
+		pid_t pid;
+
+		pid = fork();
+		if (pid == -1)
+			goto perr;
+		else if (pid == 0)
+			test(t);
+
+		ret = waitpid(pid, &status, 0);
+		if (ret == -1)
+			goto perr;
+		if (WIFSIGNALED(status)) {
+			fprintf(stderr, "%s: signaled by %s\n",
+				t->name, strsignal(WTERMSIG(status)));
+			goto err;
+		}
+		if (!WIFEXITED(status)) {
+			fprintf(stderr, "%s: does not exit\n",
+				t->name);
+			goto err;
+		}
+		if (WEXITSTATUS(status))
+			goto err;
+		ksft_inc_pass_cnt();
+		continue;
+perr:
+		perror(t->name);
+err:
+		ksft_inc_fail_cnt();
+	}
+	if (ksft_get_fail_cnt())
+		ksft_exit_fail();
+	ksft_exit_pass();
+}
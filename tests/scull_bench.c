@@ -0,0 +1,210 @@
+/* SPDX-License-Identifier: GPL-2.0 */
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <limits.h>
+#include <fcntl.h>
+#include <errno.h>
+#include <time.h>
+#include <unistd.h>
+#include <pthread.h>
+#include <sys/types.h>
+#include <sys/ioctl.h>
+
+#include "../scull.h"
+
+struct bench {
+	const char	*const name;
+	const char	*const dev;
+	size_t		size;	/* device size to fill in */
+	size_t		bsize;	/* I/O block size */
+	int		writers;	/* threads writing instead of reading */
+	unsigned int	batch;	/* records per SCULL_IOC_READV, or pread(2) */
+	int		speedup;	/* over the bench before, per threads */
+	unsigned int	secs;
+};
+
+struct worker {
+	const struct bench	*b;
+	pthread_t		tid;
+	int			fd;
+	int			write;
+	off_t			start;
+	size_t			len;
+	unsigned long		ops;
+};
+
+static volatile int stop;
+
+static void *run(void *arg)
+{
+	struct worker *w = arg;
+	size_t nr = w->len/w->b->bsize;
+	unsigned int seed = w->start;
+	char buf[w->b->bsize];
+	struct scull_rec recs[w->b->batch+1];
+	struct scull_batch batch = {
+		.recs	= (unsigned long)recs,
+		.nr	= w->b->batch,
+	};
+	ssize_t ret;
+	off_t off;
+	int i;
+
+	memset(buf, 0x5a, sizeof(buf));
+	while (!stop) {
+		if (w->b->batch && !w->write) {
+			/* all the records land on the same buffer */
+			for (i = 0; i < w->b->batch; i++) {
+				recs[i].offset = w->start+(rand_r(&seed)%nr)*w->b->bsize;
+				recs[i].len = sizeof(buf);
+				recs[i].buf = (unsigned long)buf;
+			}
+			if (ioctl(w->fd, SCULL_IOC_READV, &batch) != w->b->batch) {
+				perror(w->b->name);
+				exit(EXIT_FAILURE);
+			}
+			w->ops += w->b->batch;
+			continue;
+		}
+		off = w->start+(rand_r(&seed)%nr)*w->b->bsize;
+		if (w->write)
+			ret = pwrite(w->fd, buf, sizeof(buf), off);
+		else
+			ret = pread(w->fd, buf, sizeof(buf), off);
+		if (ret != sizeof(buf)) {
+			perror(w->b->name);
+			exit(EXIT_FAILURE);
+		}
+		w->ops++;
+	}
+	return NULL;
+}
+
+static int fill(const struct bench *restrict b, const char *path)
+{
+	char buf[BUFSIZ];
+	size_t rem;
+	ssize_t ret;
+	int fd;
+
+	fd = open(path, O_WRONLY|O_TRUNC);
+	if (fd == -1)
+		return -1;
+	memset(buf, 0xa5, sizeof(buf));
+	for (rem = b->size; rem; rem -= ret) {
+		ret = write(fd, buf, rem < sizeof(buf) ? rem : sizeof(buf));
+		if (ret == -1) {
+			close(fd);
+			return -1;
+		}
+	}
+	return close(fd);
+}
+
+/* run the benchmark with the given number of threads and return ops/sec */
+static double bench(const struct bench *restrict b, const char *path, int nr)
+{
+	struct worker workers[nr];
+	unsigned long ops = 0;
+	int i;
+
+	stop = 0;
+	for (i = 0; i < nr; i++) {
+		struct worker *w = &workers[i];
+
+		w->b = b;
+		w->ops = 0;
+		w->write = i < b->writers;
+		/* disjoint region per thread */
+		w->len = b->size/nr;
+		w->start = w->len*i;
+		w->fd = open(path, O_RDWR);
+		if (w->fd == -1)
+			goto perr;
+		if (pthread_create(&w->tid, NULL, run, w))
+			goto perr;
+	}
+	sleep(b->secs);
+	stop = 1;
+	for (i = 0; i < nr; i++) {
+		pthread_join(workers[i].tid, NULL);
+		close(workers[i].fd);
+		ops += workers[i].ops;
+	}
+	return (double)ops/b->secs;
+perr:
+	perror(b->name);
+	exit(EXIT_FAILURE);
+}
+
+int main(void)
+{
+	const struct bench *b, benches[] = {
+		{
+			.name	= "scull0 4KiB random pread(2)",
+			.dev	= "scull0",
+			.size	= 64*1024*1024,
+			.bsize	= 4096,
+			.writers	= 0,
+			.secs	= 1,
+		},
+		{
+			.name	= "scull0 4KiB random pread(2) with a pwrite(2) thread",
+			.dev	= "scull0",
+			.size	= 64*1024*1024,
+			.bsize	= 4096,
+			.writers	= 1,
+			.secs	= 1,
+		},
+		{
+			.name	= "scull0 64B random pread(2)",
+			.dev	= "scull0",
+			.size	= 64*1024*1024,
+			.bsize	= 64,
+			.writers	= 0,
+			.secs	= 1,
+		},
+		{
+			.name	= "scull0 64B random records, 64 per SCULL_IOC_READV",
+			.dev	= "scull0",
+			.size	= 64*1024*1024,
+			.bsize	= 64,
+			.writers	= 0,
+			.batch	= 64,
+			.speedup	= 1,
+			.secs	= 1,
+		},
+		{.name = NULL}, /* sentry */
+	};
+	long cpus = sysconf(_SC_NPROCESSORS_ONLN);
+	double base, ops, prev[64], cur[64];
+	char path[PATH_MAX];
+	int i, nr, ret;
+
+	for (b = benches; b->name; b++) {
+		ret = snprintf(path, sizeof(path), "/dev/%s", b->dev);
+		if (ret < 0)
+			goto perr;
+		if (fill(b, path))
+			goto perr;
+		printf("%s\n", b->name);
+		printf("%8s %14s %8s", "threads", "ops/sec", "scaling");
+		printf(b->speedup ? " %8s\n" : "\n", "speedup");
+		base = 0;
+		for (i = 0, nr = b->writers+1; nr <= cpus; i++, nr *= 2) {
+			ops = cur[i] = bench(b, path, nr);
+			if (!base)
+				base = ops;
+			printf("%8d %14.0f %7.2fx", nr, ops, ops/base);
+			if (b->speedup)
+				printf(" %7.2fx", ops/prev[i]);
+			printf("\n");
+		}
+		memcpy(prev, cur, sizeof(prev));
+	}
+	return EXIT_SUCCESS;
+perr:
+	perror(b->name);
+	return EXIT_FAILURE;
+}
@@ -7,10 +7,15 @@
 #include <errno.h>
 #include <ctype.h>
 #include <unistd.h>
+#include <signal.h>
 #include <sys/types.h>
 #include <sys/stat.h>
+#include <sys/mman.h>
+#include <sys/uio.h>
 #include <sys/wait.h>
+#include <sys/ioctl.h>
 #include "kselftest.h"
+#include "../scull.h"
 
 struct test {
 	const char	*const name;
@@ -19,9 +24,83 @@ struct test {
 	size_t		qset;
 	size_t		quantum;
 	size_t		size;
+	int		iovcnt;
+	int		mmap;
+	int		splice;
+	unsigned int	compress_ms;
+	size_t		hole;
+	int		zero;	/* all zeros write keeps the device empty */
+	int		prealloc;	/* SCULL_IOC_FALLOCATE before the write */
+	int		punch;	/* punch out the data after the read */
+	int		trim;	/* O_TRUNC after the read */
+	int		reuse;	/* rewrite the middle of each quantum after the trim */
+	const char	*numa;	/* NUMA policy for the write */
+	int		stats;	/* check the I/O statistics */
+	const char	*clone;	/* device to clone into */
+	int		snapshot;	/* overwrite the device after a snapshot */
+	int		race;	/* snapshots racing the writes over all the qsets */
+	int		tiny;	/* kept inline until the write beyond a quantum */
+	int		batch;	/* scattered records through SCULL_IOC_READV/WRITEV */
+	int		seal;	/* read and map the sealed device */
+	int		persist;	/* fsync(2) into the backing file */
+	int		lazy;	/* only the opened node gets the storage */
 	char		mark[4];
 };
 
+/* reuse() writes a mark in the middle of each quantum and reads back the
+ * whole quanta, which should be zero except the mark. */
+static int reuse(const struct test *restrict t)
+{
+	char path[PATH_MAX], buf[t->quantum];
+	size_t i, off;
+	int ret = -1;
+	int fd;
+
+	if (snprintf(path, sizeof(path), "/dev/%s", t->dev) < 0)
+		goto perr;
+	fd = open(path, O_RDWR);
+	if (fd == -1)
+		goto perr;
+	for (off = 0; off < t->size; off += t->quantum)
+		if (pwrite(fd, t->mark, 1, off+t->quantum/2) != 1)
+			goto perr_close;
+	for (off = 0; off < t->size; off += t->quantum) {
+		if (pread(fd, buf, t->quantum, off) != t->quantum)
+			goto perr_close;
+		for (i = 0; i < t->quantum; i++)
+			if (buf[i] != (i == t->quantum/2 ? t->mark[0] : 0)) {
+				fprintf(stderr, "%s: unexpected data at %ld: 0x%x\n",
+					t->name, off+i, buf[i]&0xff);
+				goto close;
+			}
+	}
+	ret = 0;
+	goto close;
+perr_close:
+	perror(t->name);
+close:
+	if (close(fd))
+		goto perr;
+	return ret;
+perr:
+	perror(t->name);
+	return -1;
+}
+
+/* split the buffer into iovcnt segments for readv(2)/writev(2) */
+static int split(struct iovec *iov, int iovcnt, void *ptr, size_t len)
+{
+	size_t seg = len/iovcnt;
+	int i;
+
+	for (i = 0; i < iovcnt; i++) {
+		iov[i].iov_base = ptr+seg*i;
+		iov[i].iov_len = seg;
+	}
+	iov[iovcnt-1].iov_len = len-seg*(iovcnt-1);
+	return iovcnt;
+}
+
 static void dump(FILE *s, const char *tag, const unsigned char *restrict buf, size_t len)
 {
 	int i, j, width = 16;
@@ -44,16 +123,731 @@ static void dump(FILE *s, const char *tag, const unsigned char *restrict buf, si
 	fprintf(s, "\n");
 }
 
+/* read or write the device attribute */
+static int attr(const char *dev, const char *name, char *buf, size_t len,
+		const char *mode)
+{
+	char path[PATH_MAX];
+	int ret;
+	FILE *fp;
+
+	ret = snprintf(path, sizeof(path), "/sys/devices/%s/%s", dev, name);
+	if (ret < 0)
+		return -1;
+	fp = fopen(path, mode);
+	if (!fp)
+		return -1;
+	if (*mode == 'w')
+		ret = fputs(buf, fp) == EOF ? -1 : 0;
+	else
+		ret = fgets(buf, len, fp) ? 0 : -1;
+	if (fclose(fp) == -1)
+		return -1;
+	return ret;
+}
+
+/* return the allocated bytes of the device */
+static long allocated(const char *dev)
+{
+	char buf[BUFSIZ];
+
+	if (attr(dev, "allocated_bytes", buf, sizeof(buf), "r"))
+		return -1;
+	return strtol(buf, NULL, 10);
+}
+
+/* fallocate(2) through SCULL_IOC_FALLOCATE, as the VFS takes it only on
+ * the regular files and the block devices */
+static int falloc(int fd, int mode, off_t offset, off_t len)
+{
+	struct scull_falloc fa = {
+		.mode	= mode,
+		.offset	= offset,
+		.len	= len,
+	};
+
+	return ioctl(fd, SCULL_IOC_FALLOCATE, &fa);
+}
+
+/* return the operations and bytes of the statistic */
+static int iostat(const char *dev, const char *name, long long *nr,
+		long long *bytes)
+{
+	char path[PATH_MAX], buf[BUFSIZ];
+
+	snprintf(path, sizeof(path), "stats/%s", name);
+	if (attr(dev, path, buf, sizeof(buf), "r"))
+		return -1;
+	if (sscanf(buf, "%lld %lld", nr, bytes) != 2)
+		return -1;
+	return 0;
+}
+
+/* write the device geometry */
+static int geometry(const char *dev, size_t qset, size_t quantum)
+{
+	char buf[BUFSIZ];
+
+	snprintf(buf, sizeof(buf), "%ld\n", qset);
+	if (attr(dev, "qset", buf, 0, "w"))
+		return -1;
+	snprintf(buf, sizeof(buf), "%ld\n", quantum);
+	return attr(dev, "quantum", buf, 0, "w");
+}
+
+/* clone src into dst, and check the copy on write */
+static int clone(const struct test *restrict t)
+{
+	struct scull_clone c = {0};
+	long long before, after, bytes;
+	char path[PATH_MAX], sbuf[BUFSIZ], dbuf[BUFSIZ];
+	int sfd = -1, dfd = -1, ret = -1;
+	ssize_t n, len;
+	off_t off;
+
+	if (geometry(t->clone, t->qset, t->quantum))
+		return -1;
+	snprintf(path, sizeof(path), "/dev/%s", t->dev);
+	sfd = open(path, O_RDONLY);
+	if (sfd == -1)
+		goto out;
+	snprintf(path, sizeof(path), "/dev/%s", t->clone);
+	dfd = open(path, O_RDWR|O_TRUNC);
+	if (dfd == -1)
+		goto out;
+	if (iostat(t->clone, "alloc", &before, &bytes))
+		goto out;
+	c.src_fd = sfd;
+	n = ioctl(dfd, SCULL_IOC_CLONE, &c);
+	if (n != t->hole+t->size) {
+		fprintf(stderr, "%s: unexpected cloned bytes: %ld\n",
+			t->name, n);
+		goto out;
+	}
+	/* only the tail could be copied */
+	if (iostat(t->clone, "alloc", &after, &bytes))
+		goto out;
+	if (after-before > 1) {
+		fprintf(stderr, "%s: unexpected allocations on clone: %lld\n",
+			t->name, after-before);
+		goto out;
+	}
+	for (off = 0; off < n; off += len) {
+		len = n-off < sizeof(sbuf) ? n-off : sizeof(sbuf);
+		if (pread(sfd, sbuf, len, off) != len)
+			goto out;
+		if (pread(dfd, dbuf, len, off) != len)
+			goto out;
+		if (memcmp(sbuf, dbuf, len)) {
+			fprintf(stderr, "%s: unexpected clone at %ld\n",
+				t->name, off);
+			goto out;
+		}
+	}
+	/* the write goes to the private copy */
+	if (pwrite(dfd, "x", 1, t->hole) != 1)
+		goto out;
+	if (pread(sfd, sbuf, 1, t->hole) != 1)
+		goto out;
+	if (sbuf[0] != t->mark[0]) {
+		fprintf(stderr, "%s: unexpected source after the write: %02x\n",
+			t->name, sbuf[0]);
+		goto out;
+	}
+	/* nothing goes beyond the largest offset */
+	c.dest_offset = LLONG_MAX-1;
+	if (ioctl(dfd, SCULL_IOC_COPY, &c) != -1 || errno != EINVAL) {
+		fprintf(stderr, "%s: unexpected copy beyond the largest offset\n",
+			t->name);
+		goto out;
+	}
+	ret = 0;
+out:
+	if (ret && errno)
+		perror(t->name);
+	if (sfd != -1)
+		close(sfd);
+	if (dfd != -1)
+		close(dfd);
+	return ret;
+}
+
+/* take a snapshot, overwrite the device, and drain the snapshot */
+static int snapshot(const struct test *restrict t)
+{
+	char path[PATH_MAX], buf[BUFSIZ];
+	int fd, sfd = -1, ret = -1;
+	ssize_t n, len;
+	off_t off;
+	size_t i;
+
+	snprintf(path, sizeof(path), "/dev/%s", t->dev);
+	fd = open(path, O_RDWR);
+	if (fd == -1)
+		goto out;
+	sfd = ioctl(fd, SCULL_IOC_SNAPSHOT);
+	if (sfd == -1)
+		goto out;
+	memset(buf, 0x11, sizeof(buf));
+	for (off = 0; off < t->size; off += n) {
+		len = t->size-off < sizeof(buf) ? t->size-off : sizeof(buf);
+		n = pwrite(fd, buf, len, t->hole+off);
+		if (n <= 0)
+			goto out;
+	}
+	if (lseek(sfd, 0, SEEK_END) != t->hole+t->size) {
+		fprintf(stderr, "%s: unexpected snapshot size\n", t->name);
+		goto out;
+	}
+	for (off = 0; off < t->hole+t->size; off += n) {
+		n = pread(sfd, buf, sizeof(buf), off);
+		if (n <= 0)
+			goto out;
+		for (i = 0; i < n; i++) {
+			char want = off+i < t->hole ? 0 :
+				t->mark[(off+i-t->hole)%sizeof(t->mark)];
+			if (buf[i] != want) {
+				fprintf(stderr, "%s: unexpected snapshot at %ld: %02x\n",
+					t->name, off+i, buf[i]);
+				goto out;
+			}
+		}
+	}
+	if (pread(fd, buf, 1, t->hole) != 1)
+		goto out;
+	if (buf[0] != 0x11) {
+		fprintf(stderr, "%s: unexpected device after the snapshot\n",
+			t->name);
+		goto out;
+	}
+	ret = 0;
+out:
+	if (ret && errno)
+		perror(t->name);
+	if (sfd != -1)
+		close(sfd);
+	if (fd != -1)
+		close(fd);
+	return ret;
+}
+
+/* take the snapshots while a child rewrites the whole device in a single
+ * write(2) each time, alternating two patterns, and check each snapshot
+ * has all of one write or all of the other */
+static int race(const struct test *restrict t)
+{
+	char path[PATH_MAX], *buf = NULL;
+	int i, fd, sfd = -1, ret = -1;
+	pid_t pid = -1;
+	size_t j;
+
+	snprintf(path, sizeof(path), "/dev/%s", t->dev);
+	fd = open(path, O_RDWR);
+	if (fd == -1)
+		goto out;
+	buf = malloc(t->size);
+	if (!buf)
+		goto out;
+	memset(buf, 0x55, t->size);
+	if (pwrite(fd, buf, t->size, 0) != t->size)
+		goto out;
+	pid = fork();
+	if (pid == -1)
+		goto out;
+	if (pid == 0)
+		for (i = 0;; i++) {
+			memset(buf, i%2 ? 0x55 : 0xaa, t->size);
+			if (pwrite(fd, buf, t->size, 0) != t->size)
+				_exit(EXIT_FAILURE);
+		}
+	for (i = 0; i < 256; i++) {
+		sfd = ioctl(fd, SCULL_IOC_SNAPSHOT);
+		if (sfd == -1)
+			goto out;
+		if (pread(sfd, buf, t->size, 0) != t->size)
+			goto out;
+		for (j = 0; j < t->size; j++)
+			if (buf[j] != buf[0] ||
+			    (buf[0] != 0x55 && buf[0] != (char)0xaa)) {
+				fprintf(stderr, "%s: torn snapshot at %ld: %02x\n",
+					t->name, j, buf[j]&0xff);
+				goto out;
+			}
+		close(sfd);
+		sfd = -1;
+	}
+	ret = 0;
+out:
+	if (ret && errno)
+		perror(t->name);
+	if (pid > 0) {
+		kill(pid, SIGKILL);
+		waitpid(pid, NULL, 0);
+	}
+	if (sfd != -1)
+		close(sfd);
+	if (fd != -1)
+		close(fd);
+	free(buf);
+	return ret;
+}
+
+/* check the inline data takes no quantum, and survives the spill */
+static int tiny(const struct test *restrict t)
+{
+	char path[PATH_MAX], buf[BUFSIZ];
+	int fd, ret = -1;
+	long got;
+	size_t i;
+
+	got = allocated(t->dev);
+	if (got) {
+		fprintf(stderr, "%s: unexpected allocated bytes inline: %ld\n",
+			t->name, got);
+		return -1;
+	}
+	snprintf(path, sizeof(path), "/dev/%s", t->dev);
+	fd = open(path, O_RDWR);
+	if (fd == -1)
+		goto out;
+	if (pwrite(fd, t->mark, 1, t->quantum) != 1)
+		goto out;
+	if (pread(fd, buf, t->size, 0) != t->size)
+		goto out;
+	for (i = 0; i < t->size; i++)
+		if (buf[i] != t->mark[i%sizeof(t->mark)]) {
+			fprintf(stderr, "%s: unexpected spilled data at %ld: %02x\n",
+				t->name, i, buf[i]);
+			goto out;
+		}
+	got = allocated(t->dev);
+	if (got != t->quantum*2) {
+		fprintf(stderr, "%s: unexpected allocated bytes spilled: %ld\n",
+			t->name, got);
+		goto out;
+	}
+	ret = 0;
+out:
+	if (ret && errno)
+		perror(t->name);
+	if (fd != -1)
+		close(fd);
+	return ret;
+}
+
+/* check the shared writable mapping reads the punched quantum as zeros,
+ * and allocates it only on the write */
+static int wmap(const struct test *restrict t)
+{
+	char path[PATH_MAX], buf[1];
+	char *map = MAP_FAILED;
+	int fd, ret = -1;
+	long got, want;
+
+	snprintf(path, sizeof(path), "/dev/%s", t->dev);
+	fd = open(path, O_RDWR);
+	if (fd == -1)
+		goto out;
+	if (falloc(fd, FALLOC_FL_PUNCH_HOLE|FALLOC_FL_KEEP_SIZE, 0, t->quantum))
+		goto out;
+	want = allocated(t->dev);
+	map = mmap(NULL, t->size, PROT_READ|PROT_WRITE, MAP_SHARED, fd, 0);
+	if (map == MAP_FAILED)
+		goto out;
+	buf[0] = map[0];
+	got = allocated(t->dev);
+	if (buf[0] || got != want) {
+		fprintf(stderr, "%s: unexpected mapped hole: %02x %ld\n",
+			t->name, buf[0]&0xff, got-want);
+		goto out;
+	}
+	map[0] = t->mark[0];
+	got = allocated(t->dev);
+	if (got != want+t->quantum) {
+		fprintf(stderr, "%s: unexpected allocated bytes mapped: %ld\n",
+			t->name, got-want);
+		goto out;
+	}
+	if (pread(fd, buf, 1, 0) != 1)
+		goto out;
+	if (buf[0] != t->mark[0]) {
+		fprintf(stderr, "%s: unexpected mapped write: %02x\n",
+			t->name, buf[0]&0xff);
+		goto out;
+	}
+	ret = 0;
+out:
+	if (ret && errno)
+		perror(t->name);
+	if (map != MAP_FAILED)
+		munmap(map, t->size);
+	if (fd != -1)
+		close(fd);
+	return ret;
+}
+
+/* read and write the scattered records in batches */
+static int batch(const struct test *restrict t)
+{
+	struct scull_rec recs[67];
+	char path[PATH_MAX], buf[64][16];
+	struct scull_batch b = {
+		.recs	= (unsigned long)recs,
+		.nr	= sizeof(recs)/sizeof(recs[0]),
+	};
+	int fd, ret = -1;
+	size_t i, j;
+
+	snprintf(path, sizeof(path), "/dev/%s", t->dev);
+	fd = open(path, O_RDWR);
+	if (fd == -1)
+		goto out;
+	for (i = 0; i < 64; i++) {
+		recs[i].offset = i*7919%(t->size-sizeof(buf[i]));
+		recs[i].len = sizeof(buf[i]);
+		recs[i].buf = (unsigned long)buf[i];
+	}
+	/* beyond the end, out of range, and the bad buffer */
+	recs[64] = (struct scull_rec){.offset = t->size, .len = 16,
+		.buf = (unsigned long)buf[0]};
+	recs[65] = (struct scull_rec){.offset = 1ULL<<63, .len = 16,
+		.buf = (unsigned long)buf[0]};
+	recs[66] = (struct scull_rec){.offset = 0, .len = 16, .buf = 0};
+	if (ioctl(fd, SCULL_IOC_READV, &b) != b.nr)
+		goto out;
+	for (i = 0; i < 64; i++) {
+		if (recs[i].res != sizeof(buf[i])) {
+			fprintf(stderr, "%s: unexpected record %ld: %lld\n",
+				t->name, i, (long long)recs[i].res);
+			goto out;
+		}
+		for (j = 0; j < sizeof(buf[i]); j++)
+			if (buf[i][j] != t->mark[(recs[i].offset+j)%sizeof(t->mark)]) {
+				fprintf(stderr, "%s: unexpected record %ld at %ld\n",
+					t->name, i, j);
+				goto out;
+			}
+	}
+	if (recs[64].res != 0 || recs[65].res != -EINVAL ||
+	    recs[66].res != -EFAULT) {
+		fprintf(stderr, "%s: unexpected records: %lld %lld %lld\n",
+			t->name, (long long)recs[64].res,
+			(long long)recs[65].res, (long long)recs[66].res);
+		goto out;
+	}
+	/* write them back with another byte, and read them again */
+	b.nr = 64;
+	memset(buf, 0x5a, sizeof(buf));
+	if (ioctl(fd, SCULL_IOC_WRITEV, &b) != b.nr)
+		goto out;
+	memset(buf, 0, sizeof(buf));
+	if (ioctl(fd, SCULL_IOC_READV, &b) != b.nr)
+		goto out;
+	for (i = 0; i < 64; i++)
+		for (j = 0; j < sizeof(buf[i]); j++)
+			if (recs[i].res != sizeof(buf[i]) || buf[i][j] != 0x5a) {
+				fprintf(stderr, "%s: unexpected written record %ld\n",
+					t->name, i);
+				goto out;
+			}
+	ret = 0;
+out:
+	if (ret && errno)
+		perror(t->name);
+	if (fd != -1)
+		close(fd);
+	return ret;
+}
+
+/* check the sealed device rejects the changes but reads and maps, and
+ * unseals only after the unmap */
+static int seal(const struct test *restrict t)
+{
+	char path[PATH_MAX], buf[BUFSIZ];
+	int fd, ret = -1;
+	char *map = NULL;
+	size_t i;
+
+	snprintf(path, sizeof(path), "/dev/%s", t->dev);
+	fd = open(path, O_RDWR);
+	if (fd == -1)
+		goto out;
+	if (ioctl(fd, SCULL_IOC_SEAL))
+		goto out;
+	if (attr(t->dev, "sealed", buf, sizeof(buf), "r"))
+		goto out;
+	if (strtol(buf, NULL, 10) != 1) {
+		fprintf(stderr, "%s: unexpected sealed: %s", t->name, buf);
+		goto out;
+	}
+	if (pwrite(fd, t->mark, 1, 0) != -1 || errno != EPERM) {
+		fprintf(stderr, "%s: unexpected write on the sealed device\n",
+			t->name);
+		goto out;
+	}
+	if (falloc(fd, FALLOC_FL_PUNCH_HOLE|FALLOC_FL_KEEP_SIZE, 0,
+		   t->size) != -1 || errno != EPERM) {
+		fprintf(stderr, "%s: unexpected punch on the sealed device\n",
+			t->name);
+		goto out;
+	}
+	if (falloc(fd, 0, t->size, t->quantum) != -1 || errno != EPERM) {
+		fprintf(stderr, "%s: unexpected preallocation on the sealed device\n",
+			t->name);
+		goto out;
+	}
+	if (mmap(NULL, t->size, PROT_READ|PROT_WRITE, MAP_SHARED, fd, 0) !=
+	    MAP_FAILED || errno != EPERM) {
+		fprintf(stderr, "%s: unexpected writable map on the sealed device\n",
+			t->name);
+		goto out;
+	}
+	map = mmap(NULL, t->size, PROT_READ, MAP_SHARED, fd, 0);
+	if (map == MAP_FAILED) {
+		map = NULL;
+		goto out;
+	}
+	for (i = 0; i < t->size; i++)
+		if (map[i] != t->mark[i%sizeof(t->mark)]) {
+			fprintf(stderr, "%s: unexpected sealed data at %ld\n",
+				t->name, i);
+			goto out;
+		}
+	if (pread(fd, buf, sizeof(buf), 0) != sizeof(buf))
+		goto out;
+	if (memcmp(buf, map, sizeof(buf))) {
+		fprintf(stderr, "%s: unexpected sealed read\n", t->name);
+		goto out;
+	}
+	/* still mapped */
+	if (ioctl(fd, SCULL_IOC_UNSEAL) != -1 || errno != EBUSY) {
+		fprintf(stderr, "%s: unexpected unseal while mapped\n",
+			t->name);
+		goto out;
+	}
+	if (munmap(map, t->size))
+		goto out;
+	map = NULL;
+	if (ioctl(fd, SCULL_IOC_UNSEAL))
+		goto out;
+	if (pwrite(fd, t->mark, 1, 0) != 1)
+		goto out;
+	ret = 0;
+out:
+	if (ret && errno)
+		perror(t->name);
+	if (map)
+		munmap(map, t->size);
+	if (fd != -1) {
+		/* leave it unsealed for the others */
+		ioctl(fd, SCULL_IOC_UNSEAL);
+		close(fd);
+	}
+	return ret;
+}
+
+/* check fsync(2) writes the data into the backing file, when the module
+ * is loaded with one, and fails otherwise */
+static int persist(const struct test *restrict t)
+{
+	char prefix[PATH_MAX], path[PATH_MAX+16], buf[BUFSIZ], data[BUFSIZ];
+	int fd = -1, bfd = -1, ret = -1;
+	size_t off, len;
+	struct stat st;
+	FILE *fp;
+
+	fp = fopen("/sys/module/scull/parameters/backing", "r");
+	if (!fp)
+		goto out;
+	if (!fgets(prefix, sizeof(prefix), fp)) {
+		fclose(fp);
+		goto out;
+	}
+	fclose(fp);
+	prefix[strcspn(prefix, "\n")] = '\0';
+	snprintf(path, sizeof(path), "/dev/%s", t->dev);
+	fd = open(path, O_RDWR);
+	if (fd == -1)
+		goto out;
+	if (!strcmp(prefix, "(null)")) {
+		if (fsync(fd) != -1 || errno != EINVAL) {
+			fprintf(stderr, "%s: unexpected fsync without the backing file\n",
+				t->name);
+			goto out;
+		}
+		ret = 0;
+		goto out;
+	}
+	if (fsync(fd))
+		goto out;
+	/* the backing file of scullN is the prefix followed by N */
+	snprintf(path, sizeof(path), "%s%s", prefix, t->dev+strlen("scull"));
+	bfd = open(path, O_RDONLY);
+	if (bfd == -1)
+		goto out;
+	if (fstat(bfd, &st))
+		goto out;
+	if (st.st_size != lseek(fd, 0, SEEK_END)) {
+		fprintf(stderr, "%s: unexpected backing file size: %ld\n",
+			t->name, (long)st.st_size);
+		goto out;
+	}
+	for (off = 0; off < st.st_size; off += len) {
+		len = st.st_size-off < sizeof(buf) ? st.st_size-off : sizeof(buf);
+		if (pread(fd, data, len, off) != len)
+			goto out;
+		if (pread(bfd, buf, len, off) != len)
+			goto out;
+		if (memcmp(data, buf, len)) {
+			fprintf(stderr, "%s: unexpected backing file data at %ld\n",
+				t->name, off);
+			goto out;
+		}
+	}
+	ret = 0;
+out:
+	if (ret && errno)
+		perror(t->name);
+	if (bfd != -1)
+		close(bfd);
+	if (fd != -1)
+		close(fd);
+	return ret;
+}
+
+/* write the last node of the freshly loaded module, and check none of
+ * the others gets the storage, and the never opened dev reads EOF */
+static int lazy(const struct test *restrict t)
+{
+	char path[PATH_MAX], name[32], buf[BUFSIZ];
+	int i, nr, fd = -1, ret = -1;
+	long got;
+	FILE *fp;
+
+	fp = fopen("/sys/module/scull/parameters/nr_devs", "r");
+	if (!fp)
+		goto out;
+	if (!fgets(buf, sizeof(buf), fp)) {
+		fclose(fp);
+		goto out;
+	}
+	fclose(fp);
+	nr = strtol(buf, NULL, 10);
+	if (nr < 1) {
+		fprintf(stderr, "%s: unexpected nr_devs: %d\n", t->name, nr);
+		goto out;
+	}
+	snprintf(name, sizeof(name), "scull%d", nr-1);
+	snprintf(path, sizeof(path), "/dev/%s", name);
+	fd = open(path, O_RDWR|O_TRUNC);
+	if (fd == -1)
+		goto out;
+	for (i = 0; i < sizeof(buf); i++)
+		buf[i] = t->mark[i%sizeof(t->mark)];
+	if (write(fd, buf, sizeof(buf)) != sizeof(buf))
+		goto out;
+	got = allocated(name);
+	if (got <= 0) {
+		fprintf(stderr, "%s: unexpected allocated bytes of %s: %ld\n",
+			t->name, name, got);
+		goto out;
+	}
+	for (i = 0; i < nr-1; i++) {
+		snprintf(name, sizeof(name), "scull%d", i);
+		got = allocated(name);
+		if (got) {
+			fprintf(stderr, "%s: unexpected allocated bytes of %s: %ld\n",
+				t->name, name, got);
+			goto out;
+		}
+	}
+	/* leave the last node empty for the others */
+	close(fd);
+	fd = open(path, O_WRONLY|O_TRUNC);
+	if (fd == -1)
+		goto out;
+	close(fd);
+	fd = -1;
+	if (nr == 1 || !strcmp(t->dev, path+strlen("/dev/"))) {
+		ret = 0;
+		goto out;
+	}
+	snprintf(path, sizeof(path), "/dev/%s", t->dev);
+	fd = open(path, O_RDONLY);
+	if (fd == -1)
+		goto out;
+	got = read(fd, buf, sizeof(buf));
+	if (got) {
+		fprintf(stderr, "%s: unexpected read of the never opened %s: %ld\n",
+			t->name, t->dev, got);
+		goto out;
+	}
+	ret = 0;
+out:
+	if (ret && errno)
+		perror(t->name);
+	if (fd != -1)
+		close(fd);
+	return ret;
+}
+
+/* return the per node counter of the node, or of all the nodes for -1 */
+static long numa_count(const char *dev, const char *name, int nid)
+{
+	char buf[BUFSIZ], *p;
+	long count = 0;
+	int n;
+
+	if (attr(dev, name, buf, sizeof(buf), "r"))
+		return -1;
+	for (p = strtok(buf, " \n"); p; p = strtok(NULL, " \n"))
+		if (sscanf(p, "N%d=", &n) == 1 && (nid == -1 || n == nid))
+			count += strtol(strchr(p, '=')+1, NULL, 10);
+	return count;
+}
+
+/* read(2) through splice(2) and a pipe */
+static ssize_t splice_read(int fd, void *buf, size_t len)
+{
+	ssize_t n, r, ret;
+	int pfd[2];
+
+	if (pipe(pfd) == -1)
+		return -1;
+	ret = n = splice(fd, NULL, pfd[1], NULL, len, 0);
+	while (n > 0) {
+		r = read(pfd[0], buf, n);
+		if (r <= 0) {
+			ret = -1;
+			break;
+		}
+		buf += r;
+		n -= r;
+	}
+	close(pfd[0]);
+	close(pfd[1]);
+	return ret;
+}
+
 static void test(const struct test *restrict t)
 {
 	char path[PATH_MAX];
 	char obuf[BUFSIZ];
 	char ibuf[BUFSIZ];
+	struct iovec iov[8];
 	size_t marksize;
-	int ret;
+	long long wnr = 0, wbytes = 0, rnr = 0, rbytes = 0;
+	long allocs = 0;
+	int ret, nid;
 	FILE *fp;
 	long got;
 
+	/* before anything instantiates the nodes */
+	if (t->lazy) {
+		if (lazy(t))
+			goto err;
+		exit(EXIT_SUCCESS);
+	}
 	/* quantum set */
 	ret = snprintf(path, sizeof(path), "/sys/devices/%s/qset", t->dev);
 	if (ret < 0)
@@ -110,6 +904,27 @@ static void test(const struct test *restrict t)
 		goto err;
 	}
 	fclose(fp);
+	/* NUMA policy */
+	if (t->numa) {
+		snprintf(obuf, sizeof(obuf), "%s\n", t->numa);
+		if (attr(t->dev, "numa_policy", obuf, 0, "w"))
+			goto perr;
+		if (attr(t->dev, "numa_policy", ibuf, sizeof(ibuf), "r"))
+			goto perr;
+		if (strcmp(obuf, ibuf)) {
+			fprintf(stderr, "%s: unexpected NUMA policy: %s",
+				t->name, ibuf);
+			goto err;
+		}
+		if (sscanf(t->numa, "%d", &nid) == 1)
+			allocs = numa_count(t->dev, "numa_allocs", nid);
+	}
+	if (t->stats) {
+		if (iostat(t->dev, "write", &wnr, &wbytes))
+			goto perr;
+		if (iostat(t->dev, "read", &rnr, &rbytes))
+			goto perr;
+	}
 	ret = snprintf(path, sizeof(path), "/dev/%s", t->dev);
 	if (ret < 0)
 		goto perr;
@@ -121,16 +936,45 @@ static void test(const struct test *restrict t)
 		fd = open(path, t->flags);
 		if (fd == -1)
 			goto perr;
+		if (t->prealloc) {
+			size_t first = t->hole/t->quantum;
+			size_t last = (t->hole+t->size+t->quantum-1)/t->quantum;
+
+			if (falloc(fd, FALLOC_FL_KEEP_SIZE, t->hole, t->size))
+				goto perr;
+			got = allocated(t->dev);
+			if (got != (last-first)*t->quantum) {
+				fprintf(stderr, "%s: unexpected preallocated bytes:\n\t- want: %ld\n\t-  got: %ld\n",
+					t->name, (last-first)*t->quantum, got);
+				goto err;
+			}
+		}
 		marksize = sizeof(t->mark);
 		for (i = 0; i < sizeof(obuf)/marksize; i++)
 			memcpy(obuf+(marksize*i), t->mark, marksize);
-		for (rem = t->size; rem; rem -= len) {
+		if (t->mmap) {
+			char *map = mmap(NULL, t->size, PROT_READ|PROT_WRITE,
+					 MAP_SHARED, fd, 0);
+			if (map == MAP_FAILED)
+				goto perr;
+			for (len = 0; len < t->size; len += sizeof(obuf))
+				memcpy(map+len, obuf, t->size-len < sizeof(obuf)
+				       ? t->size-len : sizeof(obuf));
+			if (munmap(map, t->size))
+				goto perr;
+		}
+		if (lseek(fd, t->hole, SEEK_SET) == -1)
+			goto perr;
+		for (rem = t->mmap ? 0 : t->size; rem; rem -= len) {
 			void *ptr = obuf;
 			ssize_t n, r;
 
 			n = len = rem < sizeof(obuf) ? rem : sizeof(obuf);
 write:
-			r = write(fd, ptr, n);
+			if (t->iovcnt)
+				r = writev(fd, iov, split(iov, t->iovcnt, ptr, n));
+			else
+				r = write(fd, ptr, n);
 			if (r == -1)
 				goto perr;
 			else if (r == n)
@@ -142,6 +986,67 @@ write:
 		if (close(fd))
 			goto perr;
 	}
+	/* quanta are on the bound node */
+	if (t->numa && sscanf(t->numa, "%d", &nid) == 1) {
+		int i;
+
+		got = numa_count(t->dev, "numa_allocs", nid);
+		if (got-allocs < t->size/t->quantum) {
+			fprintf(stderr, "%s: unexpected node %d allocations: %ld\n",
+				t->name, nid, got-allocs);
+			goto err;
+		}
+		/* and hold all of them, once the trimmed ones are freed */
+		for (i = 0; i < 100; i++) {
+			if (attr(t->dev, "pending_free_bytes", ibuf,
+				 sizeof(ibuf), "r"))
+				goto perr;
+			if (!strtol(ibuf, NULL, 10))
+				break;
+			usleep(10000);
+		}
+		got = numa_count(t->dev, "numa_resident", nid);
+		if (got != numa_count(t->dev, "numa_resident", -1) ||
+		    got != allocated(t->dev)/t->quantum) {
+			fprintf(stderr, "%s: unexpected node %d resident quanta: %ld\n",
+				t->name, nid, got);
+			goto err;
+		}
+	}
+	if (t->numa && attr(t->dev, "numa_policy", "local\n", 0, "w"))
+		goto perr;
+	/* and the pools filled under the old policy are gone */
+	if (t->numa) {
+		if (attr(t->dev, "pooled_bytes", ibuf, sizeof(ibuf), "r"))
+			goto perr;
+		got = strtol(ibuf, NULL, 10);
+		if (got) {
+			fprintf(stderr, "%s: unexpected pooled bytes: %ld\n",
+				t->name, got);
+			goto err;
+		}
+	}
+	/* compress the idle quanta */
+	if (t->compress_ms) {
+		snprintf(ibuf, sizeof(ibuf), "%u\n", t->compress_ms);
+		if (attr(t->dev, "compress_ms", ibuf, sizeof(ibuf), "w")) {
+			/* no compressor in the kernel */
+			if (errno != ENODEV)
+				goto perr;
+		} else {
+			usleep(t->compress_ms*4000);
+			if (attr(t->dev, "compressed_bytes", ibuf, sizeof(ibuf), "r"))
+				goto perr;
+			got = strtol(ibuf, NULL, 10);
+			if (got <= 0 || got >= t->size) {
+				fprintf(stderr, "%s: unexpected compressed bytes: %ld\n",
+					t->name, got);
+				goto err;
+			}
+			if (attr(t->dev, "compress_ms", "0\n", 0, "w"))
+				goto perr;
+		}
+	}
 	/* read */
 	if ((t->flags&O_ACCMODE) != O_WRONLY) {
 		ssize_t len, rem;
@@ -150,13 +1055,50 @@ write:
 		fd = open(path, O_RDONLY);
 		if (fd == -1)
 			goto perr;
+		if (t->hole) {
+			off_t off;
+
+			off = lseek(fd, 0, SEEK_DATA);
+			if (off == -1)
+				goto perr;
+			if (off != t->hole-t->hole%t->quantum) {
+				fprintf(stderr, "%s: unexpected SEEK_DATA:\n\t- want: %ld\n\t-  got: %ld\n",
+					t->name, t->hole-t->hole%t->quantum, off);
+				goto err;
+			}
+			off = lseek(fd, 0, SEEK_HOLE);
+			if (off == -1)
+				goto perr;
+			if (off != 0) {
+				fprintf(stderr, "%s: unexpected SEEK_HOLE:\n\t- want: 0\n\t-  got: %ld\n",
+					t->name, off);
+				goto err;
+			}
+			len = t->hole < sizeof(ibuf) ? t->hole : sizeof(ibuf);
+			if (pread(fd, ibuf, len, 0) != len)
+				goto perr;
+			for (rem = 0; rem < len; rem++)
+				if (ibuf[rem]) {
+					fprintf(stderr, "%s: unexpected data in the hole\n",
+						t->name);
+					dump(stderr, "ibuf", (unsigned char *)ibuf, len);
+					goto err;
+				}
+			if (lseek(fd, t->hole, SEEK_SET) == -1)
+				goto perr;
+		}
 		for (rem = t->size; rem; rem -= len) {
 			void *ptr = ibuf;
 			ssize_t n, r;
 
 			n = len = rem < sizeof(ibuf) ? rem : sizeof(ibuf);
 read:
-			r = read(fd, ptr, n);
+			if (t->iovcnt)
+				r = readv(fd, iov, split(iov, t->iovcnt, ptr, n));
+			else if (t->splice)
+				r = splice_read(fd, ptr, n);
+			else
+				r = read(fd, ptr, n);
 			if (r == -1)
 				goto perr;
 			else if (r == 0) {
@@ -173,6 +1115,39 @@ read:
 			n -= r;
 			goto read;
 		}
+		if (t->mmap) {
+			char *map = mmap(NULL, t->size, PROT_READ, MAP_SHARED,
+					 fd, 0);
+			if (map == MAP_FAILED)
+				goto perr;
+			for (rem = 0; rem < t->size; rem += len) {
+				len = t->size-rem < sizeof(obuf) ? t->size-rem : sizeof(obuf);
+				if (memcmp(map+rem, obuf, len)) {
+					fprintf(stderr, "%s: unexpected mapping\n",
+						t->name);
+					dump(stderr, "obuf", (unsigned char *)obuf, len);
+					dump(stderr, "map", (unsigned char *)map+rem, len);
+					goto err;
+				}
+			}
+			if (munmap(map, t->size))
+				goto perr;
+			/* the private write stays off the device */
+			map = mmap(NULL, t->size, PROT_READ|PROT_WRITE,
+				   MAP_PRIVATE, fd, 0);
+			if (map == MAP_FAILED)
+				goto perr;
+			map[0] = ~obuf[0];
+			if (munmap(map, t->size))
+				goto perr;
+			if (pread(fd, ibuf, 1, 0) != 1)
+				goto perr;
+			if (ibuf[0] != obuf[0]) {
+				fprintf(stderr, "%s: unexpected private write\n",
+					t->name);
+				goto err;
+			}
+		}
 		if (close(fd))
 			goto perr;
 	}
@@ -187,10 +1162,122 @@ read:
 	if (ferror(fp))
 		goto perr;
 	got = strtol(ibuf, NULL, 10);
-	if (got != t->size) {
+	if (got != t->hole+t->size) {
 		fprintf(stderr, "%s: unexpected size:\n\t- want: %ld\n\t-  got: %ld\n",
-			t->name, t->size, got);
+			t->name, t->hole+t->size, got);
+		goto err;
+	}
+	/* statistics */
+	if (t->stats) {
+		long long nr, bytes;
+
+		if (iostat(t->dev, "write", &nr, &bytes))
+			goto perr;
+		if (nr <= wnr || bytes-wbytes < t->size) {
+			fprintf(stderr, "%s: unexpected write stats: %lld %lld\n",
+				t->name, nr-wnr, bytes-wbytes);
+			goto err;
+		}
+		if (iostat(t->dev, "read", &nr, &bytes))
+			goto perr;
+		if (nr <= rnr || bytes-rbytes < t->size) {
+			fprintf(stderr, "%s: unexpected read stats: %lld %lld\n",
+				t->name, nr-rnr, bytes-rbytes);
+			goto err;
+		}
+	}
+	/* holes in the shared writable mapping */
+	if (t->mmap && wmap(t))
+		goto err;
+	/* clone */
+	if (t->clone && clone(t))
+		goto err;
+	/* snapshot */
+	if (t->snapshot && snapshot(t))
+		goto err;
+	if (t->race && race(t))
 		goto err;
+	/* inline data */
+	if (t->tiny && tiny(t))
+		goto err;
+	/* scattered records */
+	if (t->batch && batch(t))
+		goto err;
+	/* sealed device */
+	if (t->seal && seal(t))
+		goto err;
+	/* backing file */
+	if (t->persist && persist(t))
+		goto err;
+	/* punch out everything but keep the size */
+	if (t->punch) {
+		int fd;
+
+		ret = snprintf(path, sizeof(path), "/dev/%s", t->dev);
+		if (ret < 0)
+			goto perr;
+		fd = open(path, O_WRONLY);
+		if (fd == -1)
+			goto perr;
+		if (falloc(fd, FALLOC_FL_PUNCH_HOLE|FALLOC_FL_KEEP_SIZE,
+			   0, t->hole+t->size))
+			goto perr;
+		if (lseek(fd, 0, SEEK_DATA) != -1 || errno != ENXIO) {
+			fprintf(stderr, "%s: unexpected data after the punch\n",
+				t->name);
+			goto err;
+		}
+		if (lseek(fd, 0, SEEK_END) != t->hole+t->size) {
+			fprintf(stderr, "%s: unexpected size after the punch\n",
+				t->name);
+			goto err;
+		}
+		if (close(fd))
+			goto perr;
+	}
+	/* trim and wait for the trimmed data to be freed */
+	if (t->trim) {
+		int i, fd;
+
+		ret = snprintf(path, sizeof(path), "/dev/%s", t->dev);
+		if (ret < 0)
+			goto perr;
+		fd = open(path, O_WRONLY|O_TRUNC);
+		if (fd == -1)
+			goto perr;
+		if (lseek(fd, 0, SEEK_END) != 0) {
+			fprintf(stderr, "%s: unexpected size after the trim\n",
+				t->name);
+			goto err;
+		}
+		if (close(fd))
+			goto perr;
+		for (i = 0; i < 100; i++) {
+			if (attr(t->dev, "pending_free_bytes", ibuf,
+				 sizeof(ibuf), "r"))
+				goto perr;
+			got = strtol(ibuf, NULL, 10);
+			if (!got)
+				break;
+			usleep(10000);
+		}
+		if (got) {
+			fprintf(stderr, "%s: unexpected pending free bytes: %ld\n",
+				t->name, got);
+			goto err;
+		}
+	}
+	/* the recycled quanta should come back zeroed */
+	if (t->reuse && reuse(t))
+		goto err;
+	/* zero quanta are not allocated */
+	if ((t->zero || t->punch || t->trim) && !t->reuse) {
+		got = allocated(t->dev);
+		if (got) {
+			fprintf(stderr, "%s: unexpected allocated bytes: %ld\n",
+				t->name, got);
+			goto err;
+		}
 	}
 	exit(EXIT_SUCCESS);
 perr:
@@ -202,6 +1289,12 @@ err:
 int main(void)
 {
 	const struct test *t, tests[] = {
+		{
+			.name		= "scull0 lazily instantiated nodes",
+			.dev		= "scull0",
+			.lazy		= 1,
+			.mark		= {0x1a, 0xad, 0xbe, 0xef},
+		},
 		{
 			.name		= "scull0 read only open",
 			.dev		= "scull0",
@@ -379,6 +1472,344 @@ int main(void)
 			.size		= 4097,
 			.mark		= {0x8e, 0xad, 0xbe, 0xef},
 		},
+		{
+			.name		= "scull0 1048576 O_TRUNC write/read on (1/32)",
+			.dev		= "scull0",
+			.flags		= O_RDWR|O_TRUNC,
+			.qset		= 1,
+			.quantum	= 32,
+			.size		= 1048576,
+			.mark		= {0x9e, 0xad, 0xbe, 0xef},
+		},
+		{
+			.name		= "scull1 1048576 O_TRUNC writev/readv",
+			.dev		= "scull1",
+			.flags		= O_RDWR|O_TRUNC,
+			.qset		= 1024,
+			.quantum	= 4096,
+			.size		= 1048576,
+			.iovcnt		= 8,
+			.mark		= {0xae, 0xad, 0xbe, 0xef},
+		},
+		{
+			.name		= "scull2 4097 O_TRUNC writev/readv on (1/32)",
+			.dev		= "scull2",
+			.flags		= O_RDWR|O_TRUNC,
+			.qset		= 1,
+			.quantum	= 32,
+			.size		= 4097,
+			.iovcnt		= 3,
+			.mark		= {0xbe, 0xad, 0xbe, 0xef},
+		},
+		{
+			.name		= "scull3 65536 O_TRUNC mmap write/read",
+			.dev		= "scull3",
+			.flags		= O_RDWR|O_TRUNC,
+			.qset		= 1024,
+			.quantum	= 4096,
+			.size		= 65536,
+			.mmap		= 1,
+			.mark		= {0xce, 0xad, 0xbe, 0xef},
+		},
+		{
+			.name		= "scull0 65536 O_TRUNC mmap write/read on (4/16384)",
+			.dev		= "scull0",
+			.flags		= O_RDWR|O_TRUNC,
+			.qset		= 4,
+			.quantum	= 16384,
+			.size		= 65536,
+			.mmap		= 1,
+			.mark		= {0xde, 0xad, 0xbe, 0xef},
+		},
+		{
+			.name		= "scull1 1048576 O_TRUNC write/splice",
+			.dev		= "scull1",
+			.flags		= O_RDWR|O_TRUNC,
+			.qset		= 1024,
+			.quantum	= 4096,
+			.size		= 1048576,
+			.splice		= 1,
+			.mark		= {0x0f, 0xad, 0xbe, 0xef},
+		},
+		{
+			.name		= "scull2 4194304 O_TRUNC write/splice on (16/2097152)",
+			.dev		= "scull2",
+			.flags		= O_RDWR|O_TRUNC,
+			.qset		= 16,
+			.quantum	= 2097152,
+			.size		= 4194304,
+			.splice		= 1,
+			.mark		= {0x1f, 0xad, 0xbe, 0xef},
+		},
+		{
+			.name		= "scull3 4194304 O_TRUNC mmap write/read on (16/2097152)",
+			.dev		= "scull3",
+			.flags		= O_RDWR|O_TRUNC,
+			.qset		= 16,
+			.quantum	= 2097152,
+			.size		= 4194304,
+			.mmap		= 1,
+			.mark		= {0x2f, 0xad, 0xbe, 0xef},
+		},
+		{
+			.name		= "scull0 100 O_TRUNC write/splice on (1/32)",
+			.dev		= "scull0",
+			.flags		= O_RDWR|O_TRUNC,
+			.qset		= 1,
+			.quantum	= 32,
+			.size		= 100,
+			.splice		= 1,
+			.mark		= {0x3f, 0xad, 0xbe, 0xef},
+		},
+		{
+			.name		= "scull2 1048576 O_TRUNC write/compress/read",
+			.dev		= "scull2",
+			.flags		= O_RDWR|O_TRUNC,
+			.qset		= 16,
+			.quantum	= 4096,
+			.size		= 1048576,
+			.compress_ms	= 100,
+			.mark		= {0x4f, 0xad, 0xbe, 0xef},
+		},
+		{
+			.name		= "scull1 4096 O_TRUNC write/read after 1MiB hole",
+			.dev		= "scull1",
+			.flags		= O_RDWR|O_TRUNC,
+			.qset		= 1024,
+			.quantum	= 4096,
+			.size		= 4096,
+			.hole		= 1048576,
+			.mark		= {0xee, 0xad, 0xbe, 0xef},
+		},
+		{
+			.name		= "scull2 100 O_TRUNC write/read after 1000 bytes hole on (1/32)",
+			.dev		= "scull2",
+			.flags		= O_RDWR|O_TRUNC,
+			.qset		= 1,
+			.quantum	= 32,
+			.size		= 100,
+			.hole		= 1000,
+			.mark		= {0xfe, 0xad, 0xbe, 0xef},
+		},
+		{
+			.name		= "scull0 1048576 O_TRUNC zero write/read",
+			.dev		= "scull0",
+			.flags		= O_RDWR|O_TRUNC,
+			.qset		= 1024,
+			.quantum	= 4096,
+			.size		= 1048576,
+			.zero		= 1,
+			.mark		= {0x00, 0x00, 0x00, 0x00},
+		},
+		{
+			.name		= "scull1 100 O_TRUNC zero writev/readv on (1/32)",
+			.dev		= "scull1",
+			.flags		= O_RDWR|O_TRUNC,
+			.qset		= 1,
+			.quantum	= 32,
+			.size		= 100,
+			.iovcnt		= 3,
+			.zero		= 1,
+			.mark		= {0x00, 0x00, 0x00, 0x00},
+		},
+		{
+			.name		= "scull2 1048576 O_TRUNC fallocate/write/read/punch",
+			.dev		= "scull2",
+			.flags		= O_RDWR|O_TRUNC,
+			.qset		= 1024,
+			.quantum	= 4096,
+			.size		= 1048576,
+			.prealloc	= 1,
+			.punch		= 1,
+			.mark		= {0x5f, 0xad, 0xbe, 0xef},
+		},
+		{
+			.name		= "scull0 100 O_TRUNC fallocate/write/read/punch after 1000 bytes hole on (1/32)",
+			.dev		= "scull0",
+			.flags		= O_RDWR|O_TRUNC,
+			.qset		= 1,
+			.quantum	= 32,
+			.size		= 100,
+			.hole		= 1000,
+			.prealloc	= 1,
+			.punch		= 1,
+			.mark		= {0x6f, 0xad, 0xbe, 0xef},
+		},
+		{
+			.name		= "scull3 1048576 O_TRUNC write/read/trim",
+			.dev		= "scull3",
+			.flags		= O_RDWR|O_TRUNC,
+			.qset		= 1024,
+			.quantum	= 4096,
+			.size		= 1048576,
+			.trim		= 1,
+			.mark		= {0x7f, 0xad, 0xbe, 0xef},
+		},
+		{
+			.name		= "scull3 1048576 O_TRUNC write/read/trim on (1/32)",
+			.dev		= "scull3",
+			.flags		= O_RDWR|O_TRUNC,
+			.qset		= 1,
+			.quantum	= 32,
+			.size		= 1048576,
+			.trim		= 1,
+			.mark		= {0x8f, 0xad, 0xbe, 0xef},
+		},
+		{
+			.name		= "scull3 1048576 O_TRUNC write/read/trim/reuse",
+			.dev		= "scull3",
+			.flags		= O_RDWR|O_TRUNC,
+			.qset		= 1024,
+			.quantum	= 4096,
+			.size		= 1048576,
+			.trim		= 1,
+			.reuse		= 1,
+			.mark		= {0x2a, 0xad, 0xbe, 0xef},
+		},
+		{
+			.name		= "scull1 100 O_TRUNC write/read inline",
+			.dev		= "scull1",
+			.flags		= O_RDWR|O_TRUNC,
+			.qset		= 1024,
+			.quantum	= 4096,
+			.size		= 100,
+			.iovcnt		= 4,
+			.tiny		= 1,
+			.mark		= {0x3a, 0xad, 0xbe, 0xef},
+		},
+		{
+			.name		= "scull2 100 O_TRUNC write/read/snapshot inline",
+			.dev		= "scull2",
+			.flags		= O_RDWR|O_TRUNC,
+			.qset		= 1024,
+			.quantum	= 4096,
+			.size		= 100,
+			.snapshot	= 1,
+			.mark		= {0x4a, 0xad, 0xbe, 0xef},
+		},
+		{
+			.name		= "scull3 1048576 O_TRUNC write/read/batch",
+			.dev		= "scull3",
+			.flags		= O_RDWR|O_TRUNC,
+			.qset		= 1024,
+			.quantum	= 4096,
+			.size		= 1048576,
+			.batch		= 1,
+			.mark		= {0x6a, 0xad, 0xbe, 0xef},
+		},
+		{
+			.name		= "scull0 1048576 O_TRUNC write/read/seal",
+			.dev		= "scull0",
+			.flags		= O_RDWR|O_TRUNC,
+			.qset		= 1024,
+			.quantum	= 4096,
+			.size		= 1048576,
+			.seal		= 1,
+			.mark		= {0x7a, 0xad, 0xbe, 0xef},
+		},
+		{
+			.name		= "scull1 4096 O_TRUNC write/read/persist after 1MiB hole",
+			.dev		= "scull1",
+			.flags		= O_RDWR|O_TRUNC,
+			.qset		= 1024,
+			.quantum	= 4096,
+			.size		= 4096,
+			.hole		= 1048576,
+			.persist	= 1,
+			.mark		= {0x8a, 0xad, 0xbe, 0xef},
+		},
+		{
+			.name		= "scull1 1048576 O_TRUNC write/read on node 0",
+			.dev		= "scull1",
+			.flags		= O_RDWR|O_TRUNC,
+			.qset		= 1024,
+			.quantum	= 4096,
+			.size		= 1048576,
+			.numa		= "0",
+			.mark		= {0x9f, 0xad, 0xbe, 0xef},
+		},
+		{
+			.name		= "scull2 1048576 O_TRUNC write/read interleaved",
+			.dev		= "scull2",
+			.flags		= O_RDWR|O_TRUNC,
+			.qset		= 1024,
+			.quantum	= 4096,
+			.size		= 1048576,
+			.numa		= "interleave",
+			.mark		= {0xaf, 0xad, 0xbe, 0xef},
+		},
+		{
+			.name		= "scull0 1048576 O_TRUNC write/read with stats",
+			.dev		= "scull0",
+			.flags		= O_RDWR|O_TRUNC,
+			.qset		= 1024,
+			.quantum	= 4096,
+			.size		= 1048576,
+			.stats		= 1,
+			.mark		= {0xbf, 0xad, 0xbe, 0xef},
+		},
+		{
+			.name		= "scull3 100 O_TRUNC write/read with stats on (1/32)",
+			.dev		= "scull3",
+			.flags		= O_RDWR|O_TRUNC,
+			.qset		= 1,
+			.quantum	= 32,
+			.size		= 100,
+			.stats		= 1,
+			.mark		= {0xcf, 0xad, 0xbe, 0xef},
+		},
+		{
+			.name		= "scull0 1048576 O_TRUNC write/read/clone",
+			.dev		= "scull0",
+			.flags		= O_RDWR|O_TRUNC,
+			.qset		= 1024,
+			.quantum	= 4096,
+			.size		= 1048576,
+			.clone		= "scull1",
+			.mark		= {0xdf, 0xad, 0xbe, 0xef},
+		},
+		{
+			.name		= "scull2 100 O_TRUNC write/read/clone after 1000 bytes hole on (1/32)",
+			.dev		= "scull2",
+			.flags		= O_RDWR|O_TRUNC,
+			.qset		= 1,
+			.quantum	= 32,
+			.size		= 100,
+			.hole		= 1000,
+			.clone		= "scull3",
+			.mark		= {0xef, 0xad, 0xbe, 0xef},
+		},
+		{
+			.name		= "scull1 1048576 O_TRUNC write/read/snapshot",
+			.dev		= "scull1",
+			.flags		= O_RDWR|O_TRUNC,
+			.qset		= 1024,
+			.quantum	= 4096,
+			.size		= 1048576,
+			.snapshot	= 1,
+			.mark		= {0xff, 0xad, 0xbe, 0xef},
+		},
+		{
+			.name		= "scull1 65536 O_TRUNC write/read/snapshot racing the writes on (4/4096)",
+			.dev		= "scull1",
+			.flags		= O_RDWR|O_TRUNC,
+			.qset		= 4,
+			.quantum	= 4096,
+			.size		= 65536,
+			.race		= 1,
+			.mark		= {0x0f, 0xad, 0xbe, 0xef},
+		},
+		{
+			.name		= "scull3 100 O_TRUNC write/read/snapshot after 1000 bytes hole on (1/32)",
+			.dev		= "scull3",
+			.flags		= O_RDWR|O_TRUNC,
+			.qset		= 1,
+			.quantum	= 32,
+			.size		= 100,
+			.hole		= 1000,
+			.snapshot	= 1,
+			.mark		= {0x1a, 0xad, 0xbe, 0xef},
+		},
 		{.name = NULL}, /* sentry */
 	};
 
@@ -0,0 +1,244 @@
+/* SPDX-License-Identifier: GPL-2.0 */
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <limits.h>
+#include <fcntl.h>
+#include <errno.h>
+#include <time.h>
+#include <unistd.h>
+#include <sys/types.h>
+
+struct bench {
+	const char	*const name;
+	const char	*const dev;
+	const char	*const attr;	/* quantum attribute */
+	size_t		size;	/* device size to fill in */
+	size_t		quantum;	/* and the I/O block size */
+	unsigned int	secs;
+};
+
+static double now(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec+ts.tv_nsec/1e9;
+}
+
+static int quantum(const struct bench *restrict b)
+{
+	char path[PATH_MAX];
+	FILE *fp;
+	int ret;
+
+	ret = snprintf(path, sizeof(path), "/sys/devices/%s/%s", b->dev,
+		       b->attr);
+	if (ret < 0)
+		return -1;
+	fp = fopen(path, "w");
+	if (!fp)
+		return -1;
+	ret = fprintf(fp, "%ld\n", b->quantum) < 0 ? -1 : 0;
+	if (fclose(fp) == -1)
+		return -1;
+	return ret;
+}
+
+/* fill the trimmed device a quantum at a time, and return MiB/sec */
+static double fill(const struct bench *restrict b, const char *path)
+{
+	char buf[b->quantum];
+	double start;
+	size_t off;
+	ssize_t ret;
+	int fd;
+
+	fd = open(path, O_WRONLY|O_TRUNC);
+	if (fd == -1)
+		goto perr;
+	memset(buf, 0xa5, sizeof(buf));
+	start = now();
+	for (off = 0; off < b->size; off += ret) {
+		ret = write(fd, buf, sizeof(buf));
+		if (ret <= 0)
+			goto perr;
+	}
+	start = now()-start;
+	if (close(fd))
+		goto perr;
+	return b->size/start/(1024*1024);
+perr:
+	perror(b->name);
+	exit(EXIT_FAILURE);
+}
+
+/* read the random quanta for the duration, and return ops/sec */
+static double bench(const struct bench *restrict b, const char *path)
+{
+	size_t nr = b->size/b->quantum;
+	unsigned long ops = 0;
+	unsigned int seed = 1;
+	char buf[b->quantum];
+	double start, end;
+	int fd;
+
+	fd = open(path, O_RDONLY);
+	if (fd == -1)
+		goto perr;
+	start = now();
+	end = start+b->secs;
+	do {
+		if (pread(fd, buf, sizeof(buf), (rand_r(&seed)%nr)*b->quantum)
+		    != sizeof(buf))
+			goto perr;
+		/* not to call clock_gettime(2) on every read */
+		if (++ops%64)
+			continue;
+	} while (now() < end);
+	end = now()-start;
+	if (close(fd))
+		goto perr;
+	return ops/end;
+perr:
+	perror(b->name);
+	exit(EXIT_FAILURE);
+}
+
+/* fill the device and return the msec to trim it through O_TRUNC */
+static double trim(const struct bench *restrict b, const char *path)
+{
+	double start;
+	int fd;
+
+	fill(b, path);
+	start = now();
+	fd = open(path, O_WRONLY|O_TRUNC);
+	if (fd == -1)
+		goto perr;
+	start = now()-start;
+	if (close(fd))
+		goto perr;
+	return start*1000;
+perr:
+	perror(b->name);
+	exit(EXIT_FAILURE);
+}
+
+int main(void)
+{
+	const struct bench *b, benches[] = {
+		{
+			.name		= "scull0 quanta",
+			.dev		= "scull0",
+			.attr		= "quantum",
+			.size		= 64*1024*1024,
+			.quantum	= 512,
+			.secs		= 1,
+		},
+		{
+			.name		= "scullc0 lookaside cache quanta",
+			.dev		= "scullc0",
+			.attr		= "quantum_size",
+			.size		= 64*1024*1024,
+			.quantum	= 512,
+			.secs		= 1,
+		},
+		{
+			.name		= "scull0 quanta",
+			.dev		= "scull0",
+			.attr		= "quantum",
+			.size		= 64*1024*1024,
+			.quantum	= 4096,
+			.secs		= 1,
+		},
+		{
+			.name		= "scullc0 lookaside cache quanta",
+			.dev		= "scullc0",
+			.attr		= "quantum_size",
+			.size		= 64*1024*1024,
+			.quantum	= 4096,
+			.secs		= 1,
+		},
+		{
+			.name		= "scull0 quanta",
+			.dev		= "scull0",
+			.attr		= "quantum",
+			.size		= 64*1024*1024,
+			.quantum	= 16384,
+			.secs		= 1,
+		},
+		{
+			.name		= "scullc0 lookaside cache quanta",
+			.dev		= "scullc0",
+			.attr		= "quantum_size",
+			.size		= 64*1024*1024,
+			.quantum	= 16384,
+			.secs		= 1,
+		},
+		{
+			.name		= "scull0 quanta",
+			.dev		= "scull0",
+			.attr		= "quantum",
+			.size		= 64*1024*1024,
+			.quantum	= 65536,
+			.secs		= 1,
+		},
+		{
+			.name		= "scullc0 lookaside cache quanta",
+			.dev		= "scullc0",
+			.attr		= "quantum_size",
+			.size		= 64*1024*1024,
+			.quantum	= 65536,
+			.secs		= 1,
+		},
+		{.name = NULL}, /* sentry */
+	}, trims[] = {
+		{
+			.name		= "scull0 1GiB trim",
+			.dev		= "scull0",
+			.attr		= "quantum",
+			.size		= 1024*1024*1024,
+			.quantum	= 4096,
+		},
+		{
+			.name		= "scullc0 1GiB trim",
+			.dev		= "scullc0",
+			.attr		= "quantum_size",
+			.size		= 1024*1024*1024,
+			.quantum	= 4096,
+		},
+		{.name = NULL}, /* sentry */
+	};
+	char path[PATH_MAX];
+	double mbs, ops, msecs;
+	int ret;
+
+	printf("%-40s %8s %12s %12s\n", "bench", "quantum", "write MiB/s",
+	       "read ops/s");
+	for (b = benches; b->name; b++) {
+		ret = snprintf(path, sizeof(path), "/dev/%s", b->dev);
+		if (ret < 0)
+			goto perr;
+		if (quantum(b))
+			goto perr;
+		mbs = fill(b, path);
+		ops = bench(b, path);
+		printf("%-40s %8ld %12.1f %12.0f\n", b->name, b->quantum, mbs,
+		       ops);
+	}
+	printf("\n%-40s %8s %12s\n", "bench", "quantum", "msec");
+	for (b = trims; b->name; b++) {
+		ret = snprintf(path, sizeof(path), "/dev/%s", b->dev);
+		if (ret < 0)
+			goto perr;
+		if (quantum(b))
+			goto perr;
+		msecs = trim(b, path);
+		printf("%-40s %8ld %12.2f\n", b->name, b->quantum, msecs);
+	}
+	return EXIT_SUCCESS;
+perr:
+	perror(b->name);
+	return EXIT_FAILURE;
+}
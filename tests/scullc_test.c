@@ -8,7 +8,9 @@
 #include <unistd.h>
 #include <sys/types.h>
 #include <sys/wait.h>
+#include <sys/ioctl.h>
 #include "kselftest.h"
+#include "../scull.h"
 
 struct test {
 	const char	*const name;
@@ -17,12 +19,15 @@ struct test {
 	size_t		qset_size;
 	size_t		quantum_size;
 	size_t		qset_count;
+	size_t		prealloc;	/* SCULL_IOC_FALLOCATE before the write */
+	char		mark[4];
 };
 
 static void test(const struct test *restrict t)
 {
 	char buf[t->len > 80 ? t->len : 80];
 	char path[PATH_MAX];
+	size_t i, off;
 	int ret, fd;
 	long got;
 	FILE *fp;
@@ -66,17 +71,66 @@ static void test(const struct test *restrict t)
 	ret = snprintf(path, sizeof(path), "/dev/%s", t->dev);
 	if (ret < 0)
 		goto perr;
-	fd = open(path, O_WRONLY);
+	fd = open(path, O_WRONLY|O_TRUNC);
 	if (fd == -1)
 		goto perr;
-	ret = write(fd, buf, t->len);
-	if (ret == -1)
+	if (t->prealloc) {
+		struct scull_falloc fa = {
+			.mode	= FALLOC_FL_KEEP_SIZE,
+			.len	= t->prealloc,
+		};
+
+		if (ioctl(fd, SCULL_IOC_FALLOCATE, &fa))
+			goto perr;
+	}
+	for (i = 0; i < t->len; i++)
+		buf[i] = t->mark[i%sizeof(t->mark)];
+	/* up to 16 quanta at a time */
+	for (off = 0; off < t->len; off += ret) {
+		ret = write(fd, buf+off, t->len-off);
+		if (ret == -1)
+			goto perr;
+		if (ret == 0 || ret > 16*t->quantum_size) {
+			fprintf(stderr, "%s: unexpected write length: %d\n",
+				t->name, ret);
+			goto err;
+		}
+	}
+	if (close(fd) == -1)
 		goto perr;
-	if (ret != t->len) {
-		fprintf(stderr, "%s: unexpected write length:\n\t- want: %ld\n\t-  got: %d\n",
-			t->name, t->len, ret);
+	fd = open(path, O_RDONLY);
+	if (fd == -1)
+		goto perr;
+	got = lseek(fd, 0, SEEK_END);
+	if (got != t->len) {
+		fprintf(stderr, "%s: unexpected size:\n\t- want: %ld\n\t-  got: %ld\n",
+			t->name, t->len, got);
+		goto err;
+	}
+	if (lseek(fd, 0, SEEK_SET) != 0)
+		goto perr;
+	memset(buf, 0, t->len);
+	for (off = 0; off < t->len; off += ret) {
+		ret = read(fd, buf+off, t->len-off);
+		if (ret == -1)
+			goto perr;
+		if (ret == 0) {
+			fprintf(stderr, "%s: unexpected end of file at %ld\n",
+				t->name, off);
+			goto err;
+		}
+	}
+	if (read(fd, buf, 1) != 0) {
+		fprintf(stderr, "%s: unexpected read beyond the end\n",
+			t->name);
 		goto err;
 	}
+	for (i = 0; i < t->len; i++)
+		if (buf[i] != t->mark[i%sizeof(t->mark)]) {
+			fprintf(stderr, "%s: unexpected data at %ld\n",
+				t->name, i);
+			goto err;
+		}
 	if (close(fd) == -1)
 		goto perr;
 	ret = snprintf(path, sizeof(path), "/sys/devices/%s/qset_count", t->dev);
@@ -107,20 +161,50 @@ int main(void)
 {
 	const struct test *t, tests[] = {
 		{
-			.name		= "write 1024 bytes to scullc0",
+			.name		= "write/read 1024 bytes to scullc0",
 			.dev		= "scullc0",
 			.len		= 1024,
 			.qset_size	= 512,
 			.quantum_size	= 4096,
-			.qset_count	= (1024+1)/(512*4096)+1,
+			.qset_count	= 1,
+			.mark		= {0x1c, 0xad, 0xbe, 0xef},
 		},
 		{
-			.name		= "write 2048 bytes to scullc1",
+			.name		= "write/read 2048 bytes to scullc1",
 			.dev		= "scullc1",
 			.len		= 2048,
 			.qset_size	= 512,
 			.quantum_size	= 4096,
-			.qset_count	= (1024+1)/(512*4096)+1,
+			.qset_count	= 1,
+			.mark		= {0x2c, 0xad, 0xbe, 0xef},
+		},
+		{
+			.name		= "write/read 10000 bytes to scullc0",
+			.dev		= "scullc0",
+			.len		= 10000,
+			.qset_size	= 512,
+			.quantum_size	= 4096,
+			.qset_count	= 1,
+			.mark		= {0x3c, 0xad, 0xbe, 0xef},
+		},
+		{
+			.name		= "write/read 2MiB+1 bytes to scullc1",
+			.dev		= "scullc1",
+			.len		= 512*4096+1,
+			.qset_size	= 512,
+			.quantum_size	= 4096,
+			.qset_count	= 2,
+			.mark		= {0x4c, 0xad, 0xbe, 0xef},
+		},
+		{
+			.name		= "write/read 100000 bytes to scullc0 after 2MiB+1 prealloc",
+			.dev		= "scullc0",
+			.len		= 100000,
+			.qset_size	= 512,
+			.quantum_size	= 4096,
+			.qset_count	= 2,
+			.prealloc	= 512*4096+1,
+			.mark		= {0x5c, 0xad, 0xbe, 0xef},
 		},
 		{.name = NULL},
 	};